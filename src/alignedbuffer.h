@@ -0,0 +1,81 @@
+#pragma once
+
+#include <cstddef>
+#include <cstring>
+#include <new>
+#include <type_traits>
+#include <utility>
+
+// Fixed size, zero initialized array of trivial values whose storage starts
+// on a cache line boundary, so SIMD loads over it never split a line.
+template <typename T, std::size_t Alignment = 64>
+class AlignedBuffer {
+    static_assert(std::is_trivially_copyable_v<T>);
+
+private:
+    T*          values = nullptr;
+    std::size_t count  = 0;
+
+    void release() {
+        if (values != nullptr) {
+            ::operator delete(values, std::align_val_t{Alignment});
+        }
+        values = nullptr;
+        count  = 0;
+    }
+
+public:
+    AlignedBuffer() = default;
+
+    explicit AlignedBuffer(const std::size_t _count) {
+        resize(_count);
+    }
+
+    AlignedBuffer(AlignedBuffer&& other) noexcept : values(std::exchange(other.values, nullptr)), count(std::exchange(other.count, 0)) {
+    }
+
+    AlignedBuffer& operator=(AlignedBuffer&& other) noexcept {
+        if (this != &other) {
+            release();
+            values = std::exchange(other.values, nullptr);
+            count  = std::exchange(other.count, 0);
+        }
+        return *this;
+    }
+
+    AlignedBuffer(const AlignedBuffer&)            = delete;
+    AlignedBuffer& operator=(const AlignedBuffer&) = delete;
+
+    ~AlignedBuffer() {
+        release();
+    }
+
+    // Reallocates, the previous contents are not kept
+    void resize(const std::size_t _count) {
+        release();
+
+        if (_count > 0) {
+            values = static_cast<T*>(::operator new(sizeof(T) * _count, std::align_val_t{Alignment}));
+            count  = _count;
+            std::memset(static_cast<void*>(values), 0, sizeof(T) * count);
+        }
+    }
+
+    T* data() {
+        return values;
+    }
+    const T* data() const {
+        return values;
+    }
+
+    std::size_t size() const {
+        return count;
+    }
+
+    T& operator[](const std::size_t i) {
+        return values[i];
+    }
+    const T& operator[](const std::size_t i) const {
+        return values[i];
+    }
+};
@@ -0,0 +1,74 @@
+#include "bench.h"
+
+#include <cmath>
+#include <cstdio>
+#include <vector>
+
+BenchResult benchTrainer(Trainer& trainer, const int batches) {
+    if (!trainer.dataSetLoader.init()) {
+        return {};
+    }
+
+    const double batchSize = static_cast<double>(trainer.getBatchSize());
+
+    std::vector<double> batchLosses;
+    batchLosses.reserve(batches);
+
+    const std::uint64_t start = getTimeMs();
+
+    for (int b = 0; b < batches; ++b) {
+        trainer.step();
+
+        double batchError = 0;
+        for (int threadId = 0; threadId < trainer.getThreads(); ++threadId) {
+            batchError += static_cast<double>(trainer.losses[threadId]);
+        }
+        batchLosses.push_back(batchError / batchSize);
+
+        trainer.dataSetLoader.loadNextBatch();
+        if (trainer.dataSetLoader.hasFailed()) {
+            break;
+        }
+    }
+
+    const std::uint64_t end = getTimeMs();
+
+    double lossSum = 0;
+    for (const double loss : batchLosses) {
+        lossSum += loss;
+    }
+
+    BenchResult result;
+    result.posPerSec   = batchLosses.size() * batchSize / std::max<double>(1, end - start) * 1000.0;
+    result.averageLoss = lossSum / batchLosses.size();
+    result.finalLoss   = batchLosses.back();
+    return result;
+}
+
+void benchMixedPrecision(Trainer& reference, Trainer& mixed, const int batches) {
+    // Same starting point for both runs
+    mixed.nn.inputFeatures  = reference.nn.inputFeatures;
+    mixed.nn.inputBias      = reference.nn.inputBias;
+    mixed.nn.hiddenFeatures = reference.nn.hiddenFeatures;
+    mixed.nn.hiddenBias     = reference.nn.hiddenBias;
+
+    reference.nn.setMixedPrecision(false);
+    mixed.nn.setMixedPrecision(true);
+
+    std::cout << "Benchmarking " << batches << " batches of " << reference.getBatchSize() << " positions" << std::endl;
+
+    const BenchResult fp32 = benchTrainer(reference, batches);
+    const BenchResult bf16 = benchTrainer(mixed, batches);
+
+    printf("fp32: speed: [%9.0f] pos/s | avg error: [%11.9f] | final error: [%11.9f]\n", fp32.posPerSec, fp32.averageLoss, fp32.finalLoss);
+    printf("bf16: speed: [%9.0f] pos/s | avg error: [%11.9f] | final error: [%11.9f]\n", bf16.posPerSec, bf16.averageLoss, bf16.finalLoss);
+    printf("speedup: [%5.3fx] | avg error diff: [%+.3e] (%+.3f%%) | final error diff: [%+.3e]\n", bf16.posPerSec / fp32.posPerSec, bf16.averageLoss - fp32.averageLoss,
+           100.0 * (bf16.averageLoss - fp32.averageLoss) / fp32.averageLoss, bf16.finalLoss - fp32.finalLoss);
+
+    // Largest difference between the fp32 weights both runs ended with
+    float maxWeightDiff = 0;
+    for (int i = 0; i < INPUT_SIZE * HIDDEN_SIZE; ++i) {
+        maxWeightDiff = std::max(maxWeightDiff, std::abs(mixed.nn.inputFeatures[i] - reference.nn.inputFeatures[i]));
+    }
+    printf("max input weight diff: [%.6e]\n", maxWeightDiff);
+}
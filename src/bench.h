@@ -0,0 +1,17 @@
+#pragma once
+
+#include "trainer.h"
+
+struct BenchResult {
+    double posPerSec;
+    double averageLoss;
+    double finalLoss;
+};
+
+// Trains `batches` batches and measures throughput and loss per position
+BenchResult benchTrainer(Trainer& trainer, const int batches);
+
+// Trains the same initial network once in fp32 and once with the bf16
+// forward shadow and reports the throughput gain and how far the losses
+// drift apart. Both trainers must be configured identically.
+void benchMixedPrecision(Trainer& reference, Trainer& mixed, const int batches);
@@ -0,0 +1,241 @@
+#include "binpackreader.h"
+
+#include <algorithm>
+#include <filesystem>
+#include <iostream>
+#include <thread>
+
+namespace DataLoader {
+
+    bool BinpackIndex::open(const std::string& path, const int threads) {
+        chunks.clear();
+
+        std::error_code error;
+        IndexHeader     expected{};
+
+        expected.fileSize = std::filesystem::file_size(path, error);
+        if (error) {
+            return false;
+        }
+
+        expected.modified = std::filesystem::last_write_time(path, error).time_since_epoch().count();
+        if (error) {
+            return false;
+        }
+
+        if (!load(path, expected)) {
+            if (!build(path, expected.fileSize, threads)) {
+                return false;
+            }
+            save(path, expected);
+        }
+
+        starts.resize(chunks.size());
+        total = 0;
+        for (std::size_t i = 0; i < chunks.size(); ++i) {
+            starts[i] = total;
+            total += chunks[i].positions;
+        }
+
+        return !chunks.empty();
+    }
+
+    bool BinpackIndex::load(const std::string& path, const IndexHeader& expected) {
+        std::ifstream input(indexPath(path), std::ios::binary);
+        if (!input) {
+            return false;
+        }
+
+        IndexHeader header;
+        input.read(reinterpret_cast<char*>(&header), sizeof(header));
+
+        if (!input || std::memcmp(header.magic, INDEX_MAGIC, sizeof(INDEX_MAGIC)) != 0 || header.version != INDEX_VERSION || header.fileSize != expected.fileSize
+            || header.modified != expected.modified) {
+            std::cout << "Chunk index " << indexPath(path) << " is stale, rebuilding it" << std::endl;
+            return false;
+        }
+
+        chunks.resize(header.chunkCount);
+        input.read(reinterpret_cast<char*>(chunks.data()), chunks.size() * sizeof(ChunkInfo));
+
+        if (!input) {
+            std::cout << "Chunk index " << indexPath(path) << " is truncated, rebuilding it" << std::endl;
+            chunks.clear();
+            return false;
+        }
+
+        // Catches a binpack rewritten to the same size within the timestamp's resolution
+        if (edges(path) != header.edges) {
+            std::cout << "Chunk index " << indexPath(path) << " doesn't match " << path << ", rebuilding it" << std::endl;
+            chunks.clear();
+            return false;
+        }
+
+        return true;
+    }
+
+    // Hashes the BINP header and the first bytes of the first and last chunk
+    std::uint64_t BinpackIndex::edges(const std::string& path) const {
+        std::ifstream input(path, std::ios::binary);
+        std::uint64_t hash = 0xCBF29CE484222325ull;
+
+        if (chunks.empty()) {
+            return hash;
+        }
+
+        for (const ChunkInfo* chunk : {&chunks.front(), &chunks.back()}) {
+            unsigned char bytes[64] = {};
+            input.seekg(chunk->offset - 8);
+            input.read(reinterpret_cast<char*>(bytes), std::min<std::uint64_t>(sizeof(bytes), chunk->size + 8));
+
+            for (const unsigned char byte : bytes) {
+                hash = (hash ^ byte) * 0x100000001B3ull;
+            }
+        }
+
+        return input ? hash : ~hash;
+    }
+
+    bool BinpackIndex::build(const std::string& path, const std::uint64_t fileSize, const int threads) {
+        std::ifstream input(path, std::ios::binary);
+        if (!input) {
+            return false;
+        }
+
+        // Chunk sizes chain the headers together, so this part is a serial
+        // walk, but it only reads 8 bytes per chunk
+        std::uint64_t offset = 0;
+
+        while (offset + 8 <= fileSize) {
+            unsigned char header[8];
+            input.seekg(offset);
+            input.read(reinterpret_cast<char*>(header), sizeof(header));
+
+            if (!input || header[0] != 'B' || header[1] != 'I' || header[2] != 'N' || header[3] != 'P') {
+                std::cout << "Invalid binpack chunk header at offset " << offset << " in " << path << std::endl;
+                break;
+            }
+
+            const std::uint32_t size = header[4] | (header[5] << 8) | (header[6] << 16) | (header[7] << 24);
+
+            if (size > binpack::maxChunkSize || offset + 8 + size > fileSize) {
+                std::cout << "Truncated binpack chunk at offset " << offset << " in " << path << std::endl;
+                break;
+            }
+
+            chunks.push_back({offset + 8, size, 0});
+            offset += 8 + size;
+        }
+
+        // A move's bit width in the movetext depends on the position it's
+        // played in, so counting a stem's plies means replaying its moves.
+        // That's a full decode of every chunk, spread over the threads.
+        std::atomic<std::size_t> nextChunk{0};
+
+        auto worker = [&]() {
+            std::ifstream              file(path, std::ios::binary);
+            std::vector<unsigned char> buffer;
+
+            for (std::size_t i; (i = nextChunk.fetch_add(1)) < chunks.size();) {
+                buffer.resize(chunks[i].size);
+                file.seekg(chunks[i].offset);
+                file.read(reinterpret_cast<char*>(buffer.data()), buffer.size());
+
+                std::uint32_t positions = 0;
+                decodeChunk(buffer, [&positions](const binpack::TrainingDataEntry&) { positions++; });
+                chunks[i].positions = positions;
+            }
+        };
+
+        std::vector<std::thread> workers;
+        for (int i = 0; i < std::max(1, threads); ++i) {
+            workers.emplace_back(worker);
+        }
+        for (auto& thread : workers) {
+            thread.join();
+        }
+
+        return !chunks.empty();
+    }
+
+    void BinpackIndex::save(const std::string& path, IndexHeader header) const {
+        std::memcpy(header.magic, INDEX_MAGIC, sizeof(INDEX_MAGIC));
+        header.version    = INDEX_VERSION;
+        header.chunkCount = chunks.size();
+        header.edges      = edges(path);
+
+        std::ofstream output(indexPath(path), std::ios::binary | std::ios::trunc);
+        output.write(reinterpret_cast<const char*>(&header), sizeof(header));
+        output.write(reinterpret_cast<const char*>(chunks.data()), chunks.size() * sizeof(ChunkInfo));
+
+        if (!output) {
+            std::cout << "Couldn't write chunk index " << indexPath(path) << ", it will be rebuilt next time" << std::endl;
+        }
+    }
+
+    Cursor BinpackIndex::locate(const std::uint64_t position) const {
+        const std::uint64_t wrapped = total > 0 ? position % total : 0;
+
+        // Last chunk starting at or before the position
+        const auto          it    = std::upper_bound(starts.begin(), starts.end(), wrapped) - 1;
+        const std::uint64_t chunk = it - starts.begin();
+
+        return {chunk, wrapped - *it};
+    }
+
+    bool BinpackFile::open(const std::string& path, const int threads) {
+        if (!index.open(path, threads) || !file.open(path)) {
+            return false;
+        }
+
+        file.advise(0, file.size(), MappedFile::Advice::Sequential);
+        return true;
+    }
+
+    bool ChunkSource::open(const bool _useMmap, const int threads) {
+        useMmap = _useMmap;
+
+        if (useMmap && !binpack.open(path, threads)) {
+            std::cout << "Couldn't map " << path << ", streaming it instead" << std::endl;
+            useMmap = false;
+        }
+
+        if (!useMmap) {
+            stream.open(path, std::ios::binary);
+            return stream && index.open(path, threads);
+        }
+
+        return true;
+    }
+
+    bool ChunkSource::read(const std::uint64_t position, Chunk& chunk) {
+        if (chunks().chunkCount() == 0) {
+            return false;
+        }
+
+        const std::size_t i = position % chunks().chunkCount();
+
+        if (useMmap) {
+            binpack.prefetch((i + 1) % binpack.chunkCount());
+
+            chunk.data = binpack.chunk(i);
+            return true;
+        }
+
+        chunk.buffer.resize(index[i].size);
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stream.seekg(index[i].offset);
+            stream.read(reinterpret_cast<char*>(chunk.buffer.data()), chunk.buffer.size());
+
+            if (!stream) {
+                std::cout << "Couldn't read chunk " << i << " of " << path << std::endl;
+                return false;
+            }
+        }
+
+        chunk.data = chunk.buffer;
+        return true;
+    }
+
+} // namespace DataLoader
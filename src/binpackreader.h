@@ -0,0 +1,236 @@
+#pragma once
+
+// turn off warnings for this
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wall"
+#include "binpack/nnue_data_binpack_format.h"
+#pragma GCC diagnostic pop
+
+#include "mappedfile.h"
+
+#include <atomic>
+#include <fstream>
+#include <memory>
+#include <mutex>
+#include <span>
+#include <string>
+#include <vector>
+
+namespace DataLoader {
+
+    struct ChunkInfo {
+        std::uint64_t offset; // of the chunk data, past the BINP header
+        std::uint32_t size;
+        std::uint32_t positions;
+    };
+
+    static_assert(sizeof(ChunkInfo) == 16);
+
+    // A place in the position stream: a chunk counted over every pass of the
+    // file, and the number of its positions to skip. For training caches the
+    // chunk is a block step and the positions are records.
+    struct Cursor {
+        std::uint64_t chunk = 0;
+        std::uint64_t entry = 0;
+    };
+
+    // Chunk table of a binpack, kept next to it in <path>.idx:
+    //
+    //   IndexHeader
+    //   ChunkInfo[chunkCount]
+    //
+    // Building it walks the BINP headers and counts the positions of every
+    // chunk in parallel, later opens read the sidecar back as long as the
+    // binpack keeps its size and modification time and the first and last
+    // chunk still start with the same bytes.
+    struct IndexHeader {
+        char          magic[8];
+        std::uint32_t version;
+        std::uint32_t reserved;
+        std::uint64_t fileSize;
+        std::uint64_t chunkCount;
+        std::int64_t  modified; // last write time of the binpack
+        std::uint64_t edges;    // checksum of the start of the first and last chunk
+    };
+
+    static_assert(sizeof(IndexHeader) == 48);
+
+    constexpr char          INDEX_MAGIC[8] = {'R', 'I', 'C', 'E', 'B', 'I', 'D', 'X'};
+    constexpr std::uint32_t INDEX_VERSION  = 2;
+
+    class BinpackIndex {
+    private:
+        std::vector<ChunkInfo>     chunks;
+        std::vector<std::uint64_t> starts; // positions before each chunk
+        std::uint64_t              total = 0;
+
+        bool          load(const std::string& path, const IndexHeader& expected);
+        bool          build(const std::string& path, std::uint64_t fileSize, int threads);
+        void          save(const std::string& path, IndexHeader header) const;
+        std::uint64_t edges(const std::string& path) const;
+
+    public:
+        // Reads the sidecar index or builds it on `threads` threads
+        bool open(const std::string& path, int threads);
+
+        static std::string indexPath(const std::string& path) {
+            return path + ".idx";
+        }
+
+        std::size_t chunkCount() const {
+            return chunks.size();
+        }
+
+        const ChunkInfo& operator[](const std::size_t index) const {
+            return chunks[index];
+        }
+
+        std::uint64_t positionCount() const {
+            return total;
+        }
+
+        // Chunk holding the n-th position of the file, wrapping around at the end
+        Cursor locate(std::uint64_t position) const;
+    };
+
+    // Memory mapped binpack file, chunks are handed out as views straight
+    // into the mapping, in any order
+    class BinpackFile {
+    private:
+        MappedFile   file;
+        BinpackIndex index;
+
+    public:
+        bool open(const std::string& path, int threads);
+
+        const BinpackIndex& chunks() const {
+            return index;
+        }
+
+        std::size_t chunkCount() const {
+            return index.chunkCount();
+        }
+
+        std::span<const unsigned char> chunk(const std::size_t i) const {
+            return {file.data() + index[i].offset, index[i].size};
+        }
+
+        // Asks the kernel to start reading a chunk ahead of its use
+        void prefetch(const std::size_t i) const {
+            if (i < index.chunkCount()) {
+                file.advise(index[i].offset, index[i].size, MappedFile::Advice::WillNeed);
+            }
+        }
+    };
+
+    // One binpack chunk. In streaming mode the view points into `buffer`,
+    // when mapped it points into the file mapping.
+    struct Chunk {
+        std::span<const unsigned char> data;
+        std::vector<unsigned char>     buffer;
+    };
+
+    // Hands out whole binpack chunks to any number of decoder threads,
+    // starting over at the beginning of the file once it's exhausted.
+    // Chunks are claimed in order and read in parallel. Both modes read
+    // through the chunk index, so seeking is free.
+    class ChunkSource {
+    private:
+        std::string path;
+        bool        useMmap = true;
+
+        // Mapped mode
+        BinpackFile binpack;
+
+        // Streaming mode
+        BinpackIndex  index;
+        std::ifstream stream;
+        std::mutex    mutex;
+
+        std::atomic<std::uint64_t> nextChunk{0};
+
+        const BinpackIndex& chunks() const {
+            return useMmap ? binpack.chunks() : index;
+        }
+
+    public:
+        explicit ChunkSource(const std::string& _path) : path(_path) {
+        }
+
+        // Opens the file, falls back to streaming if it can't be mapped.
+        // `threads` build the chunk index if it doesn't exist yet.
+        bool open(const bool _useMmap, int threads);
+
+        // Claims the next chunk, counting every pass over the file
+        std::uint64_t take() {
+            return nextChunk.fetch_add(1, std::memory_order_relaxed);
+        }
+
+        // Reads a chunk claimed with take(), false if it can't be read
+        bool read(std::uint64_t position, Chunk& chunk);
+
+        bool isMapped() const {
+            return useMmap;
+        }
+
+        // Chunks handed out so far, counting every pass over the file
+        std::uint64_t position() const {
+            return nextChunk.load(std::memory_order_relaxed);
+        }
+
+        // Continues at the cursor's chunk, only call it before the first
+        // take(). Skipping the cursor's positions is up to the caller.
+        void seek(const Cursor& cursor) {
+            nextChunk = cursor.chunk;
+        }
+
+        std::size_t chunkCount() const {
+            return chunks().chunkCount();
+        }
+
+        std::uint64_t positionCount() const {
+            return chunks().positionCount();
+        }
+
+        const std::string& filePath() const {
+            return path;
+        }
+
+        // Cursor of the n-th position in the file
+        Cursor locate(const std::uint64_t position) const {
+            return chunks().locate(position);
+        }
+    };
+
+    // Calls f(entry) for every training entry stored in one binpack chunk.
+    // Chunks are self contained, so any number of them can be decoded in parallel.
+    template <typename F>
+    void decodeChunk(const std::span<const unsigned char> chunk, F&& f) {
+        const unsigned char* data   = chunk.data();
+        const std::size_t    size   = chunk.size();
+        std::size_t          offset = 0;
+
+        while (offset + sizeof(binpack::PackedTrainingDataEntry) + 2 <= size) {
+            binpack::PackedTrainingDataEntry packed;
+            std::memcpy(&packed, data + offset, sizeof(binpack::PackedTrainingDataEntry));
+            offset += sizeof(binpack::PackedTrainingDataEntry);
+
+            const std::uint16_t numPlies = (data[offset] << 8) | data[offset + 1];
+            offset += 2;
+
+            const binpack::TrainingDataEntry entry = binpack::unpackEntry(packed);
+            f(entry);
+
+            if (numPlies > 0) {
+                binpack::PackedMoveScoreListReader movelist(entry, const_cast<unsigned char*>(data + offset), numPlies);
+
+                while (movelist.hasNext()) {
+                    f(movelist.nextEntry());
+                }
+
+                offset += movelist.numReadBytes();
+            }
+        }
+    }
+
+} // namespace DataLoader
@@ -0,0 +1,136 @@
+#include "checkpoint.h"
+
+#include <cstring>
+#include <iostream>
+
+namespace Checkpoint {
+
+    namespace {
+        const char PADDING[SECTION_ALIGNMENT] = {};
+
+        std::uint64_t alignUp(const std::uint64_t x) {
+            return (x + SECTION_ALIGNMENT - 1) / SECTION_ALIGNMENT * SECTION_ALIGNMENT;
+        }
+    } // namespace
+
+    // FNV-1a over 8 byte words with an extra shift so high bits feed back
+    std::uint64_t checksum(const void* data, const std::size_t size) {
+        const unsigned char* bytes = static_cast<const unsigned char*>(data);
+
+        std::uint64_t hash = 0xCBF29CE484222325ull;
+        std::size_t   i    = 0;
+
+        for (; i + 8 <= size; i += 8) {
+            std::uint64_t word;
+            std::memcpy(&word, bytes + i, sizeof(word));
+            hash = (hash ^ word) * 0x100000001B3ull;
+            hash ^= hash >> 29;
+        }
+
+        for (; i < size; ++i) {
+            hash = (hash ^ bytes[i]) * 0x100000001B3ull;
+        }
+
+        return hash;
+    }
+
+    void Builder::add(const SectionId id, const void* section, const std::size_t size, const std::uint32_t index) {
+        table.push_back({static_cast<std::uint32_t>(id) + index, 0, offset, size, 0});
+        data.push_back({section, size});
+
+        offset = alignUp(offset + size);
+    }
+
+    FileSnapshot Builder::snapshot(const std::string& path) {
+        std::memcpy(header.magic, MAGIC, sizeof(MAGIC));
+        header.version      = VERSION;
+        header.sectionCount = static_cast<std::uint32_t>(table.size());
+
+        // Offsets so far are relative to the first section
+        const std::uint64_t start = alignUp(sizeof(FileHeader) + table.size() * sizeof(SectionEntry));
+        for (SectionEntry& entry : table) {
+            entry.offset += start;
+        }
+
+        FileSnapshot file{path, {{&header, sizeof(header)}, {table.data(), table.size() * sizeof(SectionEntry)}}, {}};
+
+        std::uint64_t position = sizeof(FileHeader) + table.size() * sizeof(SectionEntry);
+        for (std::size_t i = 0; i < data.size(); ++i) {
+            file.sections.push_back({PADDING, table[i].offset - position});
+            file.sections.push_back(data[i]);
+            position = table[i].offset + table[i].size;
+        }
+
+        file.finalize = [](char* bytes, std::size_t) {
+            FileHeader fileHeader;
+            std::memcpy(&fileHeader, bytes, sizeof(fileHeader));
+
+            for (std::uint32_t i = 0; i < fileHeader.sectionCount; ++i) {
+                char* entryBytes = bytes + sizeof(FileHeader) + i * sizeof(SectionEntry);
+
+                SectionEntry entry;
+                std::memcpy(&entry, entryBytes, sizeof(entry));
+                entry.checksum = checksum(bytes + entry.offset, entry.size);
+                std::memcpy(entryBytes, &entry, sizeof(entry));
+            }
+        };
+
+        return file;
+    }
+
+    bool Reader::open(const std::string& path) {
+        if (!file.open(path)) {
+            std::cout << "Couldn't open checkpoint " << path << std::endl;
+            return false;
+        }
+
+        FileHeader header;
+        if (file.size() < sizeof(header)) {
+            std::cout << "Checkpoint " << path << " is truncated" << std::endl;
+            return false;
+        }
+        std::memcpy(&header, file.data(), sizeof(header));
+
+        if (std::memcmp(header.magic, MAGIC, sizeof(MAGIC)) != 0 || header.version != VERSION) {
+            std::cout << "Checkpoint " << path << " has an unknown format or version" << std::endl;
+            return false;
+        }
+
+        if (file.size() < sizeof(FileHeader) + static_cast<std::uint64_t>(header.sectionCount) * sizeof(SectionEntry)) {
+            std::cout << "Checkpoint " << path << " is truncated" << std::endl;
+            return false;
+        }
+
+        table = reinterpret_cast<const SectionEntry*>(file.data() + sizeof(FileHeader));
+        count = header.sectionCount;
+
+        for (std::uint32_t i = 0; i < count; ++i) {
+            const SectionEntry& entry = table[i];
+
+            if (entry.offset > file.size() || entry.size > file.size() - entry.offset) {
+                std::cout << "Checkpoint " << path << " is truncated" << std::endl;
+                return false;
+            }
+
+            if (checksum(file.data() + entry.offset, entry.size) != entry.checksum) {
+                std::cout << "Checkpoint " << path << " is corrupted, section " << entry.id << " fails its checksum" << std::endl;
+                return false;
+            }
+        }
+
+        return true;
+    }
+
+    std::span<const unsigned char> Reader::section(const SectionId id, const std::uint32_t index) const {
+        const std::uint32_t wanted = static_cast<std::uint32_t>(id) + index;
+
+        for (std::uint32_t i = 0; i < count; ++i) {
+            if (table[i].id == wanted) {
+                return {file.data() + table[i].offset, table[i].size};
+            }
+        }
+
+        return {};
+    }
+
+} // namespace Checkpoint
@@ -0,0 +1,104 @@
+#pragma once
+
+#include "checkpointwriter.h"
+#include "mappedfile.h"
+
+#include <cstdint>
+#include <span>
+#include <string>
+#include <vector>
+
+// Full training state checkpoint (.ckpt): a header, a table of sections
+// and the sections themselves, each 64 byte aligned so the loader can use
+// them straight from a memory mapping. Every section carries a checksum.
+//
+//   FileHeader
+//   SectionEntry[sectionCount]
+//   section data, padded to SECTION_ALIGNMENT
+namespace Checkpoint {
+
+    constexpr char          MAGIC[8]          = {'R', 'I', 'C', 'E', 'C', 'K', 'P', 'T'};
+    constexpr std::uint32_t VERSION           = 1;
+    constexpr std::size_t   SECTION_ALIGNMENT = 64;
+
+    enum class SectionId : std::uint32_t {
+        InputFeatures,
+        InputBias,
+        HiddenFeatures,
+        HiddenBias,
+        TrainingState,
+        RowSteps,
+        // M and V of every layer, in NNGradients::layers() order
+        Moments,
+        // Ids after Moments belong to the moments of the following layers
+        DatasetCursor = 0x100,
+        // DataLoader::StreamCursor, where the shuffled stream continues
+        DatasetStream = 0x101,
+    };
+
+    struct FileHeader {
+        char          magic[8];
+        std::uint32_t version;
+        std::uint32_t sectionCount;
+    };
+
+    struct SectionEntry {
+        std::uint32_t id;
+        std::uint32_t reserved;
+        std::uint64_t offset;
+        std::uint64_t size;
+        std::uint64_t checksum;
+    };
+
+    struct TrainingState {
+        float         learningRate;
+        std::uint32_t epoch; // completed epochs
+        std::uint64_t batches;
+        std::uint64_t step; // optimizer steps
+        // Binpack chunk or cache block of the first file the resumed run
+        // starts reading at. The DatasetCursor section holds a
+        // DataLoader::Cursor for every file of the dataset, DatasetStream the
+        // position in the shuffled stream after them.
+        std::uint64_t datasetCursor;
+        std::uint32_t optimizer;
+        std::uint32_t momentStorage;
+    };
+
+    static_assert(sizeof(FileHeader) == 16);
+    static_assert(sizeof(SectionEntry) == 32);
+    static_assert(sizeof(TrainingState) == 40);
+
+    std::uint64_t checksum(const void* data, std::size_t size);
+
+    // Lays out a checkpoint from sections that stay valid until the
+    // snapshot has been handed to the CheckpointWriter
+    class Builder {
+    private:
+        FileHeader                header;
+        std::vector<SectionEntry> table;
+        std::vector<FileSection>  data;
+        std::uint64_t             offset = 0;
+
+    public:
+        // Moments sections are numbered by adding the index to SectionId::Moments
+        void add(SectionId id, const void* section, std::size_t size, std::uint32_t index = 0);
+
+        // Checksums are computed on the writer thread
+        FileSnapshot snapshot(const std::string& path);
+    };
+
+    class Reader {
+    private:
+        MappedFile          file;
+        const SectionEntry* table = nullptr;
+        std::uint32_t       count = 0;
+
+    public:
+        // Maps the file and validates the header, the table and every checksum
+        bool open(const std::string& path);
+
+        // Empty if the checkpoint doesn't have the section
+        std::span<const unsigned char> section(SectionId id, std::uint32_t index = 0) const;
+    };
+
+} // namespace Checkpoint
@@ -0,0 +1,201 @@
+#include "checkpointwriter.h"
+#include "threadpool.h"
+
+#include <algorithm>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+
+#if defined(__unix__) || defined(__APPLE__)
+    #define HAS_FSYNC
+    #include <fcntl.h>
+    #include <unistd.h>
+#endif
+
+CheckpointWriter::CheckpointWriter() : thread(&CheckpointWriter::writeLoop, this) {
+}
+
+CheckpointWriter::~CheckpointWriter() {
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        stopping = true;
+    }
+    condition.notify_all();
+
+    thread.join();
+}
+
+void CheckpointWriter::wait() {
+    std::unique_lock<std::mutex> lock(mutex);
+    condition.wait(lock, [this] { return !pending; });
+}
+
+void CheckpointWriter::write(const std::vector<FileSnapshot>& files, ThreadPool& pool, std::function<void()> after) {
+    wait();
+
+    job = std::move(after);
+
+    // Sizes are the same every save, so after the first one this doesn't allocate
+    if (buffers.size() < files.size()) {
+        buffers.resize(files.size());
+    }
+    count = files.size();
+
+    struct Copy {
+        char*       dst;
+        const char* src;
+        std::size_t size;
+    };
+
+    std::vector<Copy> copies;
+    std::size_t       total = 0;
+
+    for (std::size_t i = 0; i < files.size(); ++i) {
+        const FileSnapshot& file   = files[i];
+        Buffer&             buffer = buffers[i];
+
+        buffer.path     = file.path;
+        buffer.finalize = file.targets.empty() ? file.finalize : nullptr;
+        buffer.parts.clear();
+
+        if (file.targets.empty()) {
+            std::size_t size = 0;
+            for (const FileSection& section : file.sections) {
+                size += section.size;
+            }
+
+            buffer.data.resize(size);
+            buffer.parts.push_back({buffer.data.data(), size});
+        }
+
+        char* dst = buffer.data.data();
+        for (std::size_t j = 0; j < file.sections.size(); ++j) {
+            const FileSection& section = file.sections[j];
+
+            if (file.targets.empty()) {
+                copies.push_back({dst, static_cast<const char*>(section.data), section.size});
+                dst += section.size;
+            } else {
+                copies.push_back({static_cast<char*>(file.targets[j]), static_cast<const char*>(section.data), section.size});
+                buffer.parts.push_back({file.targets[j], section.size});
+            }
+
+            total += section.size;
+        }
+    }
+
+    // Every thread copies an equal share of the bytes, whichever sections they fall in
+    pool.run([&](const int threadId) {
+        const std::size_t begin = total * threadId / pool.size();
+        const std::size_t end   = total * (threadId + 1) / pool.size();
+
+        std::size_t offset = 0;
+        for (const Copy& copy : copies) {
+            const std::size_t from = std::max(begin, offset);
+            const std::size_t to   = std::min(end, offset + copy.size);
+
+            if (from < to) {
+                std::memcpy(copy.dst + (from - offset), copy.src + (from - offset), to - from);
+            }
+
+            offset += copy.size;
+        }
+    });
+
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        pending = true;
+    }
+    condition.notify_all();
+}
+
+bool CheckpointWriter::writeFile(const std::string& path, const std::vector<FileSection>& parts) {
+    const std::string tmpPath = path + ".tmp";
+
+#if defined(HAS_FSYNC)
+    const int fd = ::open(tmpPath.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    bool      ok = fd >= 0;
+
+    for (const FileSection& part : parts) {
+        const char* data = static_cast<const char*>(part.data);
+
+        for (std::size_t written = 0; ok && written < part.size;) {
+            const ssize_t n = ::write(fd, data + written, part.size - written);
+            ok              = n > 0;
+            written += ok ? n : 0;
+        }
+    }
+
+    // The rename must not reach the disk before the data
+    ok = ok && ::fsync(fd) == 0;
+
+    if (fd >= 0) {
+        ok = ::close(fd) == 0 && ok;
+    }
+#else
+    std::ofstream file(tmpPath, std::ios::binary);
+    for (const FileSection& part : parts) {
+        file.write(static_cast<const char*>(part.data), part.size);
+    }
+    file.close();
+
+    const bool ok = static_cast<bool>(file);
+#endif
+
+    if (!ok) {
+        std::cout << "Couldn't write checkpoint file " << path << std::endl;
+        return false;
+    }
+
+    std::error_code error;
+    std::filesystem::rename(tmpPath, path, error);
+
+    if (error) {
+        std::cout << "Couldn't rename " << tmpPath << " to " << path << ": " << error.message() << std::endl;
+        return false;
+    }
+
+#if defined(HAS_FSYNC)
+    // Makes the rename itself durable
+    const std::string directory = std::filesystem::path(path).parent_path().string();
+    const int         dirFd     = ::open(directory.empty() ? "." : directory.c_str(), O_RDONLY);
+    if (dirFd >= 0) {
+        ::fsync(dirFd);
+        ::close(dirFd);
+    }
+#endif
+
+    return true;
+}
+
+void CheckpointWriter::writeLoop() {
+    std::unique_lock<std::mutex> lock(mutex);
+
+    for (;;) {
+        condition.wait(lock, [this] { return pending || stopping; });
+
+        if (pending) {
+            // The buffers belong to this thread until pending is cleared
+            lock.unlock();
+            for (std::size_t i = 0; i < count; ++i) {
+                if (buffers[i].finalize) {
+                    buffers[i].finalize(buffers[i].data.data(), buffers[i].data.size());
+                }
+                if (!buffers[i].path.empty()) {
+                    writeFile(buffers[i].path, buffers[i].parts);
+                }
+            }
+
+            if (job) {
+                job();
+            }
+            lock.lock();
+
+            pending = false;
+            condition.notify_all();
+        } else if (stopping) {
+            return;
+        }
+    }
+}
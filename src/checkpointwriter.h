@@ -0,0 +1,81 @@
+#pragma once
+
+#include <condition_variable>
+#include <cstddef>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+class ThreadPool;
+
+// A range of bytes, files are written as their sections back to back
+struct FileSection {
+    const void* data;
+    std::size_t size;
+};
+
+struct FileSnapshot {
+    std::string              path; // empty to only copy the sections
+    std::vector<FileSection> sections;
+
+    // Runs on the writer thread over the copied bytes before they are
+    // written, e.g. to fill in checksums
+    std::function<void(char* data, std::size_t size)> finalize;
+
+    // Section i is copied to targets[i] instead of a buffer of the writer's
+    // and written from there, e.g. straight into the net the export job
+    // reads. Not combined with finalize.
+    std::vector<void*> targets;
+};
+
+// Writes checkpoints off the training thread. write() copies every file
+// into snapshot buffers that are reused from save to save, split across
+// the trainer's pool, and returns right away. A background thread then
+// writes each file to <path>.tmp, flushes it to the disk and renames it
+// over <path>, so neither a crash nor a power loss leaves a truncated
+// checkpoint behind.
+class CheckpointWriter {
+private:
+    struct Buffer {
+        std::string                                       path;
+        std::vector<char>                                 data;
+        std::vector<FileSection>                          parts; // in data or the targets
+        std::function<void(char* data, std::size_t size)> finalize;
+    };
+
+    std::vector<Buffer>   buffers;
+    std::size_t           count = 0;
+    std::function<void()> job;
+
+    std::thread             thread;
+    std::mutex              mutex;
+    std::condition_variable condition;
+    bool                    pending  = false;
+    bool                    stopping = false;
+
+    void writeLoop();
+
+public:
+    CheckpointWriter();
+    ~CheckpointWriter();
+
+    CheckpointWriter(const CheckpointWriter&)            = delete;
+    CheckpointWriter& operator=(const CheckpointWriter&) = delete;
+
+    // Waits for the previous checkpoint to reach the disk first, only
+    // call it while no job runs on the pool. `after` runs on the writer
+    // thread once the files are written, on data it owns until then.
+    void write(const std::vector<FileSnapshot>& files, ThreadPool& pool, std::function<void()> after = {});
+
+    // Writes <path>.tmp, syncs it and renames it over <path>
+    static bool writeFile(const std::string& path, const std::vector<FileSection>& parts);
+
+    static bool writeFile(const std::string& path, const char* data, const std::size_t size) {
+        return writeFile(path, {{data, size}});
+    }
+
+    // Blocks until the last checkpoint is written
+    void wait();
+};
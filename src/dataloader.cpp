@@ -1,65 +1,636 @@
 #include "dataloader.h"
+#include "checkpointwriter.h"
+#include "nn.h"
+#include "random.h"
+#include <bit>
+#include <chrono>
 #include <ctime>
+#include <type_traits>
 
 namespace DataLoader {
+    namespace {
+        std::uint64_t nowNs() {
+            return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+        }
+
+        // Pops from the queue, spinning briefly before backing off to sleeps.
+        // Returns false if `stopping` got set while waiting.
+        bool waitPop(BoundedQueue<Batch*>& queue, Batch*& batch, const std::atomic<bool>& stopping) {
+            for (int attempt = 0; !queue.tryPop(batch); ++attempt) {
+                if (stopping.load(std::memory_order_relaxed)) {
+                    return false;
+                }
+
+                if (attempt < 64) {
+                    std::this_thread::yield();
+                } else {
+                    std::this_thread::sleep_for(std::chrono::microseconds(50));
+                }
+            }
+            return true;
+        }
+    } // namespace
+
+    void Batch::add(const DataSetEntry& entry) {
+        const PackedEntry& packed = entry.entry;
+
+        const std::uint8_t us   = packed.stm;
+        const std::uint8_t them = !packed.stm;
+
+        std::int16_t* stmRow  = stmFeatures.data() + offsets[size];
+        std::int16_t* nstmRow = nstmFeatures.data() + offsets[size];
+
+        // Pieces are stored in bitboard order, one chess::Piece id per occupied square
+        int i = 0;
+        for (std::uint64_t pieces = packed.occupancy; pieces; pieces &= pieces - 1, ++i) {
+            const int          sq         = std::countr_zero(pieces);
+            const std::uint8_t piece      = packed.pieceAt(i);
+            const std::uint8_t pieceType  = piece >> 1;
+            const std::uint8_t pieceColor = piece & 1;
+
+            stmRow[i]  = inputIndex(pieceType, pieceColor, sq, us, packed.kingSquares[us]);
+            nstmRow[i] = inputIndex(pieceType, pieceColor, sq, them, packed.kingSquares[them]);
+        }
+
+        stm[size]         = us;
+        eval[size]        = entry.score();
+        wdl[size]         = entry.wdl();
+        offsets[size + 1] = offsets[size] + i;
+        size++;
+    }
+
+    FileSnapshot Batch::snapshot(Batch& into, const std::size_t count) const {
+        const std::uint32_t features = offsets[count];
+
+        into.size = count;
+
+        return {
+            "",
+            {
+                {offsets.data(), sizeof(std::uint32_t) * (count + 1)},
+                {stmFeatures.data(), sizeof(std::int16_t) * features},
+                {nstmFeatures.data(), sizeof(std::int16_t) * features},
+                {stm.data(), count},
+                {eval.data(), sizeof(float) * count},
+                {wdl.data(), sizeof(float) * count},
+            },
+            {},
+            {into.offsets.data(), into.stmFeatures.data(), into.nstmFeatures.data(), into.stm.data(), into.eval.data(), into.wdl.data()},
+        };
+    }
+
+    DataSetLoader::~DataSetLoader() {
+        stopping = true;
+        wakeAll();
+
+        for (auto& producer : producers) {
+            producer.join();
+        }
+        if (readingThread.joinable()) {
+            readingThread.join();
+        }
+    }
+
     void DataSetLoader::loadNextBatch() {
-        positionIndex += batchSize;
+        if (current != nullptr) {
+            releaseBatch(current);
+        }
+
+        current = acquireBatch();
+    }
+
+    Batch* DataSetLoader::acquireBatch() {
+        Batch* batch = nullptr;
+
+        queueDepthSum += readyBatches.size();
+        batchesConsumed++;
+
+        // Only blocks when the producers are behind
+        if (!readyBatches.tryPop(batch)) {
+            const std::uint64_t start = nowNs();
+            waitPop(readyBatches, batch, stopping);
+            trainerStallNs += nowNs() - start;
+        }
+
+        if (batch != nullptr) {
+            handedOut += batch->size;
+        }
+
+        return batch;
+    }
+
+    void DataSetLoader::releaseBatch(Batch* batch) {
+        freeBatches.tryPush(batch);
+    }
+
+    void DataSetLoader::produceBatches() {
+        for (;;) {
+            Batch* batch;
+
+            if (!freeBatches.tryPop(batch)) {
+                const std::uint64_t start = nowNs();
+                const bool          ok    = waitPop(freeBatches, batch, stopping);
+                producerStallNs += nowNs() - start;
+
+                if (!ok) {
+                    return;
+                }
+            }
+
+            std::uint64_t ticket;
+            if (!fillBatch(*batch, ticket)) {
+                return;
+            }
+
+            // Batches claimed earlier go first
+            while (published.load(std::memory_order_acquire) != ticket) {
+                if (stopping) {
+                    return;
+                }
+                std::this_thread::yield();
+            }
+
+            readyBatches.tryPush(batch);
+            published.store(ticket + 1, std::memory_order_release);
+        }
+    }
+
+    bool DataSetLoader::fillBatch(Batch& batch, std::uint64_t& ticket) {
+        struct Slice {
+            std::shared_ptr<DecodedChunk> chunk;
+            std::size_t            offset;
+            std::size_t            count;
+        };
+
+        // Claim the positions under the lock, a batch can span two chunks
+        Slice       slices[2];
+        int         sliceCount = 0;
+        std::size_t needed     = batchSize;
+
+        {
+            std::lock_guard<std::mutex> lock(claimMutex);
+
+            while (needed > 0) {
+                if (currentChunk == nullptr || chunkOffset == CHUNK_SIZE) {
+                    std::unique_lock<std::mutex> chunkLock(chunkMutex);
+                    chunkCondition.wait(chunkLock, [this] { return readyChunk != nullptr || stopping; });
+
+                    if (stopping) {
+                        return false;
+                    }
+
+                    // A resumed run starts past the positions of its first chunk that were trained on
+                    chunkOffset  = currentChunk == nullptr ? firstEntry : 0;
+                    currentChunk = std::move(readyChunk);
+                    chunkCondition.notify_all();
+                }
+
+                const std::size_t count = std::min(needed, CHUNK_SIZE - chunkOffset);
+                slices[sliceCount++]    = {currentChunk, chunkOffset, count};
+                chunkOffset += count;
+                needed -= count;
+            }
+
+            ticket = tickets++;
+        }
+
+        // Featurize outside the lock so producers work in parallel
+        batch.clear();
+
+        for (int i = 0; i < sliceCount; ++i) {
+            const DataSetEntry* entries = slices[i].chunk->data() + slices[i].offset;
+            for (std::size_t j = 0; j < slices[i].count; ++j) {
+                batch.add(entries[j]);
+            }
+        }
+
+        return true;
+    }
+
+    void DataSetLoader::readChunks() {
+        if (!fillWindow()) {
+            return fail();
+        }
+
+        const std::uint64_t chunks = window.size();
+
+        for (std::uint64_t index = firstChunk; !stopping; ++index) {
+            std::shared_ptr<DecodedChunk> chunk = takeChunk();
+            if (chunk == nullptr) {
+                return;
+            }
+
+            mix(*chunk, index);
+
+            {
+                std::unique_lock<std::mutex> lock(chunkMutex);
+                chunkCondition.wait(lock, [this] { return readyChunk == nullptr || stopping; });
+
+                readyChunk = std::move(chunk);
+                chunkCondition.notify_all();
+            }
+
+            // Decoded chunk `index` gave out its last slice, its buffer takes the next one
+            if (!loadNext(window[index % chunks], index + chunks)) {
+                return fail();
+            }
+        }
+    }
+
+    void DataSetLoader::fail() {
+        if (!stopping) {
+            std::cout << "Couldn't read " << path << " anymore, stopping the loader" << std::endl;
+        }
+
+        failed   = true;
+        stopping = true;
+        wakeAll();
+    }
+
+    // Waiters check stopping under their mutex, so taking each one once
+    // after setting it means none of them misses the wakeup
+    void DataSetLoader::wakeAll() {
+        {
+            std::lock_guard<std::mutex> lock(chunkMutex);
+        }
+        chunkCondition.notify_all();
+
+        {
+            std::lock_guard<std::mutex> lock(poolMutex);
+        }
+        poolCondition.notify_all();
+
+        {
+            std::lock_guard<std::mutex> lock(commitMutex);
+        }
+        commitCondition.notify_all();
+    }
+
+    // Waits for a free chunk buffer, null once the loader is stopping. The
+    // buffer returns to the pool when its last owner lets go.
+    std::shared_ptr<DecodedChunk> DataSetLoader::takeChunk() {
+        std::unique_lock<std::mutex> lock(poolMutex);
+        poolCondition.wait(lock, [this] { return !freeChunks.empty() || stopping; });
+
+        if (stopping) {
+            return nullptr;
+        }
+
+        DecodedChunk* chunk = freeChunks.back();
+        freeChunks.pop_back();
+
+        return std::shared_ptr<DecodedChunk>(chunk, [this](DecodedChunk* released) {
+            {
+                std::lock_guard<std::mutex> lock(poolMutex);
+                freeChunks.push_back(released);
+            }
+            poolCondition.notify_all();
+        });
+    }
+
+    bool DataSetLoader::loadNext(DecodedChunk& chunk, const std::uint64_t index) {
+        {
+            std::lock_guard<std::mutex> lock(commitMutex);
+
+            filling      = &chunk;
+            fillingIndex = index;
+            filled       = 0;
+
+            // Pieces claimed past the end of the previous chunk go first
+            while (!carried.empty() && filled < CHUNK_SIZE) {
+                append(carried.front());
+
+                if (carried.front().used == carried.front().entries.size()) {
+                    carried.pop_front();
+                }
+            }
+
+            if (filled == CHUNK_SIZE) {
+                return true;
+            }
+        }
+
+        decoders->run([this](const int) {
+            decodeChunks();
+        });
+
+        // Decoders only stop short when their sources fail
+        std::lock_guard<std::mutex> lock(commitMutex);
+        return filled == CHUNK_SIZE;
+    }
+
+    void DataSetLoader::decodeChunks() {
+        Piece       piece;
+        Chunk       chunk;
+        FilterStats filterStats;
+
+        // Checks stopping before every piece, with filters that reject
+        // everything the chunk would never fill up
+        for (;;) {
+            {
+                std::lock_guard<std::mutex> lock(commitMutex);
+                if (filled == CHUNK_SIZE || readFailed || stopping) {
+                    return;
+                }
+            }
+
+            if (!takePiece(piece, chunk)) {
+                {
+                    std::lock_guard<std::mutex> lock(commitMutex);
+                    readFailed = true;
+                }
+                commitCondition.notify_all();
+                return;
+            }
+
+            decodePiece(piece, chunk, filterStats);
+            filterCounters.add(filterStats);
+
+            // Pieces enter the stream in the order they were claimed
+            std::unique_lock<std::mutex> lock(commitMutex);
+            commitCondition.wait(lock, [&] { return committed == piece.sequence || readFailed || stopping; });
+
+            if (committed != piece.sequence) {
+                return;
+            }
+
+            committed++;
+            append(piece);
+
+            if (piece.used < piece.entries.size()) {
+                carried.push_back(std::move(piece));
+            }
+
+            commitCondition.notify_all();
+        }
+    }
+
+    bool DataSetLoader::takePiece(Piece& piece, Chunk& chunk) {
+        {
+            std::lock_guard<std::mutex> lock(scheduleMutex);
+
+            piece.sequence = claimed++;
+            piece.before   = readCursors();
+            piece.file     = 0;
+
+            if (cache.isOpen()) {
+                piece.position = cacheStep.fetch_add(1);
+                return true;
+            }
+
+            // Every chunk taken is charged with the file's average chunk, so
+            // the choice doesn't wait for the read and only depends on the
+            // files' cursors
+            auto share = [this](const std::size_t i) {
+                return sources[i]->position() * (static_cast<double>(sources[i]->positionCount()) / sources[i]->chunkCount()) / weights[i];
+            };
 
-        if (positionIndex == CHUNK_SIZE) {
-            // Join thread that's reading nextData
-            if (readingThread.joinable()) {
-                readingThread.join();
+            for (std::size_t i = 1; i < sources.size(); ++i) {
+                if (share(i) < share(piece.file)) {
+                    piece.file = i;
+                }
             }
 
-            // Bring next data to current position
-            std::swap(currentData, nextData);
-            positionIndex = 0;
+            piece.position = sources[piece.file]->take();
+        }
+
+        return sources[piece.file]->read(piece.position, chunk);
+    }
+
+    void DataSetLoader::decodePiece(Piece& piece, const Chunk& chunk, FilterStats& filterStats) {
+        piece.entries.clear();
+        piece.raw.clear();
+        piece.used = 0;
+
+        // Seeded by the piece, so a resumed run filters it the same way. The
+        // positions before the cursor were trained on already, the filters
+        // still see them to keep the random stream in step.
+        Random              random(seed ^ splitmix64(static_cast<std::uint64_t>(piece.file) << 48 ^ piece.position));
+        const std::uint64_t skip  = piece.before[piece.file].entry;
+        std::uint32_t       index = 0;
+        FilterStats         skipped;
+
+        auto visit = [&](const auto& entry) {
+            const bool accepted = filters.accept(entry, random, index < skip ? skipped : filterStats);
+
+            if (accepted && index >= skip) {
+                if constexpr (std::is_same_v<std::decay_t<decltype(entry)>, PackedEntry>) {
+                    piece.entries.push_back({entry});
+                } else {
+                    piece.entries.push_back({PackedEntry::fromEntry(entry)});
+                }
+                piece.raw.push_back(index);
+            }
+
+            index++;
+        };
+
+        if (cache.isOpen()) {
+            // Cached records already went through the board filters
+            for (const PackedEntry& record : cache.block(cache.blockAt(piece.position))) {
+                visit(record);
+            }
+        } else {
+            decodeChunk(chunk.data, visit);
+        }
+    }
+
+    // Moves as many of the piece's entries as fit into the decoded chunk
+    // being filled. Call with commitMutex held.
+    bool DataSetLoader::append(Piece& piece) {
+        const std::size_t count = std::min(piece.entries.size() - piece.used, CHUNK_SIZE - filled);
+
+        if (count == 0) {
+            return filled < CHUNK_SIZE;
+        }
+
+        // The chunk starts at this entry, the resume point of everything mixed from it on
+        if (filled == 0) {
+            std::vector<Cursor> start   = piece.before;
+            start[piece.file].entry     = piece.raw[piece.used];
+            const std::uint64_t trainer = (firstChunk * CHUNK_SIZE + firstEntry + handedOut.load() - std::min<std::uint64_t>(handedOut.load(), batchSize)) / CHUNK_SIZE;
+
+            std::lock_guard<std::mutex> lock(startsMutex);
+            chunkStarts[fillingIndex] = std::move(start);
+            chunkStarts.erase(chunkStarts.begin(), chunkStarts.lower_bound(trainer));
+        }
+
+        std::copy(piece.entries.begin() + piece.used, piece.entries.begin() + piece.used + count, filling->begin() + filled);
+        filled += count;
+        piece.used += count;
+
+        return filled < CHUNK_SIZE;
+    }
+
+    bool DataSetLoader::fillWindow() {
+        const std::size_t chunks = reservoirSize / CHUNK_SIZE;
+
+        window.assign(chunks, DecodedChunk(CHUNK_SIZE));
+        order.resize(CHUNK_SIZE);
+
+        std::cout << "Filling the shuffle buffer with " << reservoirSize << " positions" << std::endl;
 
-            // Begin a new thread to read nextData
-            readingThread = std::thread(&DataSetLoader::loadNext, this);
+        for (std::uint64_t index = firstChunk; index < firstChunk + chunks && !stopping; ++index) {
+            if (!loadNext(window[index % chunks], index)) {
+                return false;
+            }
         }
+
+        return true;
     }
 
-    void DataSetLoader::loadNext() {
-        for (std::size_t counter = 0; counter < CHUNK_SIZE; ++counter) {
-            // If we finished, go back to the beginning
-            if (!reader.hasNext()) {
-                reader = binpack::CompressedTrainingDataEntryReader(path);
+    void DataSetLoader::mix(DecodedChunk& chunk, const std::uint64_t index) {
+        const std::uint64_t chunks = window.size();
+
+        // Fisher-Yates over the slots, only 4 bytes each
+        Random random(seed ^ splitmix64(index));
+
+        std::iota(order.begin(), order.end(), 0u);
+        for (std::size_t i = CHUNK_SIZE - 1; i > 0; --i) {
+            std::swap(order[i], order[random.below(i + 1)]);
+        }
+
+        // Slot k lies in slice k * W / CHUNK_SIZE of every decoded chunk
+        decoders->run([&](const int threadId) {
+            const auto [begin, end] = decoders->range(static_cast<int>(CHUNK_SIZE), threadId);
+
+            for (int i = begin; i < end; ++i) {
+                const std::uint64_t slot  = order[i];
+                const std::uint64_t slice = slot * chunks / CHUNK_SIZE;
+                chunk[i]                  = window[(index + slice) % chunks][slot];
             }
+        });
+    }
+
+    DataSetLoader::Stats DataSetLoader::stats() {
+        const std::uint64_t consumed = std::max<std::uint64_t>(1, batchesConsumed.exchange(0));
 
-            DataSetEntry& positionEntry = nextData[permuteShuffle[counter]];
+        return {static_cast<double>(queueDepthSum.exchange(0)) / consumed, trainerStallNs.exchange(0) / 1000000, producerStallNs.exchange(0) / 1000000};
+    }
 
-            // Get info
-            positionEntry.entry = reader.next();
+    // Call with scheduleMutex held
+    std::vector<Cursor> DataSetLoader::readCursors() const {
+        if (cache.isOpen()) {
+            const std::uint64_t step = cacheStep.load();
+            return {{step, step == startCursors[0].chunk ? startCursors[0].entry : 0}};
+        }
 
-            bool earlySkip = positionEntry.entry.ply <= 16;
-            bool filter = positionEntry.entry.isInCheck() || positionEntry.entry.isCapturingMove();
+        std::vector<Cursor> result;
+        for (std::size_t i = 0; i < sources.size(); ++i) {
+            const std::uint64_t chunk = sources[i]->position();
+            result.push_back({chunk, chunk == startCursors[i].chunk ? startCursors[i].entry : 0});
+        }
 
-            if (positionEntry.entry.score == 32002) {
-                counter--;
+        return result;
+    }
+
+    StreamCursor DataSetLoader::streamCursor() const {
+        const std::uint64_t position = firstChunk * CHUNK_SIZE + firstEntry + handedOut.load() - (current != nullptr ? current->size : 0);
+        return {seed, reservoirSize / CHUNK_SIZE, position / CHUNK_SIZE, position % CHUNK_SIZE};
+    }
+
+    std::vector<Cursor> DataSetLoader::cursors() const {
+        const std::uint64_t chunk = streamCursor().chunk;
+
+        std::lock_guard<std::mutex> lock(startsMutex);
+        const auto                  it = chunkStarts.find(chunk);
+        return it != chunkStarts.end() ? it->second : startCursors;
+    }
+
+    void DataSetLoader::openFiles() {
+        const std::vector<DataSetFile> files = parseDataSet(path);
+
+        // A cache is read on its own, mixing happens when converting
+        if (files.size() == 1 && CacheFile::isCache(files[0].path)) {
+            if (!cache.open(files[0].path)) {
+                std::cout << "Couldn't open training cache " << files[0].path << std::endl;
+            }
+            return;
+        }
+
+        for (const DataSetFile& file : files) {
+            if (CacheFile::isCache(file.path)) {
+                std::cout << "Training cache " << file.path << " can't be mixed with other files, leaving it out" << std::endl;
                 continue;
             }
-            
-            if (earlySkip || filter) {
-                counter--;
+
+            auto source = std::make_unique<ChunkSource>(file.path);
+            if (!source->open(useMmap, decoderThreads)) {
+                std::cout << "Couldn't open binpack " << file.path << std::endl;
                 continue;
             }
+
+            sources.push_back(std::move(source));
+            weights.push_back(file.weight);
+        }
+
+        if (sources.size() > 1) {
+            const double total = std::accumulate(weights.begin(), weights.end(), 0.0);
+
+            for (std::size_t i = 0; i < sources.size(); ++i) {
+                printf("  %5.1f%% %s (%zu chunks, %llu positions)\n", 100.0 * weights[i] / total, sources[i]->filePath().c_str(), sources[i]->chunkCount(),
+                       static_cast<unsigned long long>(sources[i]->positionCount()));
+            }
         }
     }
 
-    void DataSetLoader::shuffle() {
-        std::mt19937 mt{static_cast<std::mt19937::result_type>(69)};
-        std::iota(permuteShuffle.begin(), permuteShuffle.end(), 0);
-        std::shuffle(permuteShuffle.begin(), permuteShuffle.end(), mt);
-    }
+    bool DataSetLoader::init() {
+        openFiles();
+
+        const std::size_t fileCount = cache.isOpen() ? 1 : sources.size();
 
-    void DataSetLoader::init() {
-        positionIndex = 0;
+        if (fileCount == 0) {
+            std::cout << "Dataset " << path << " has no readable files" << std::endl;
+            return false;
+        }
+
+        if (startCursors.size() != fileCount) {
+            if (!startCursors.empty()) {
+                std::cout << "Dataset position covers " << startCursors.size() << " file(s) but " << path << " has " << fileCount << ", starting over" << std::endl;
+            }
+            startCursors.assign(fileCount, Cursor{});
+        }
+
+        if (cache.isOpen()) {
+            if (startPosition > 0) {
+                startCursors[0] = {startPosition / CACHE_BLOCK_SIZE, startPosition % CACHE_BLOCK_SIZE};
+            }
+            cacheStep = startCursors[0].chunk;
+        }
+
+        for (std::size_t i = 0; i < sources.size(); ++i) {
+            if (startPosition > 0) {
+                startCursors[i] = sources[i]->locate(startPosition);
+            }
+            sources[i]->seek(startCursors[i]);
+        }
+
+        batches.resize(BATCH_QUEUE_DEPTH);
+        for (auto& batch : batches) {
+            batch.allocate(batchSize);
+            freeBatches.tryPush(&batch);
+        }
+
+        chunkPool.assign(CHUNK_POOL_SIZE, DecodedChunk(CHUNK_SIZE));
+        for (auto& chunk : chunkPool) {
+            freeChunks.push_back(&chunk);
+        }
+
+        decoders      = std::make_unique<ThreadPool>(decoderThreads);
+        readingThread = std::thread(&DataSetLoader::readChunks, this);
+        for (int i = 0; i < producerThreads; ++i) {
+            producers.emplace_back(&DataSetLoader::produceBatches, this);
+        }
+
+        loadNextBatch();
+        stats();
+
+        if (current == nullptr) {
+            return false;
+        }
 
-        shuffle();
+        std::cout << "Loaded " << path << " with batch size " << batchSize << " using " << decoderThreads << " decoder threads" << (cache.isOpen() ? " (cache)" : sources[0]->isMapped() ? " (mapped)" : "") << std::endl;
 
-        loadNext();
-        std::swap(currentData, nextData);
-        loadNext();
+        return true;
     }
-} // namespace DataLoader
\ No newline at end of file
+} // namespace DataLoader
@@ -2,11 +2,13 @@
 
 #include "types.h"
 
-// turn off warnings for this
-#pragma GCC diagnostic push
-#pragma GCC diagnostic ignored "-Wall"
-#include "binpack/nnue_data_binpack_format.h"
-#pragma GCC diagnostic pop
+#include "alignedbuffer.h"
+#include "binpackreader.h"
+#include "boundedqueue.h"
+#include "datasetspec.h"
+#include "filter.h"
+#include "threadpool.h"
+#include "trainingcache.h"
 
 #include <algorithm>
 #include <fstream>
@@ -15,14 +17,24 @@
 #include <sstream>
 #include <string>
 #include <array>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <map>
+#include <memory>
+#include <mutex>
 #include <thread>
+#include <vector>
 
 constexpr std::size_t CHUNK_SIZE = (1 << 20);
 
+struct FileSnapshot;
+
 namespace DataLoader {
 
+    // 32 bytes per position instead of a full binpack::TrainingDataEntry (224 bytes)
     struct DataSetEntry {
-        binpack::TrainingDataEntry entry;
+        PackedEntry entry;
 
         const float score() const {
             // if (entry.pos.sideToMove() == chess::Color::White) {
@@ -54,38 +66,302 @@ namespace DataLoader {
         }
 
         const auto sideToMove() const {
-            return entry.pos.sideToMove();
+            return entry.stm;
         }
     };
 
+    // One buffer of CHUNK_SIZE decoded positions
+    using DecodedChunk = std::vector<DataSetEntry>;
+
+    // Most pieces a position can have, and so features per perspective
+    constexpr std::size_t MAX_FEATURES = 32;
+
+    // A featurized batch in CSR form. The features of position i from the
+    // side to move's and the other side's point of view are
+    // stmFeatures / nstmFeatures[offsets[i] .. offsets[i + 1]).
+    struct Batch {
+        std::size_t size = 0;
+
+        AlignedBuffer<std::uint32_t> offsets;
+        AlignedBuffer<std::int16_t>  stmFeatures;
+        AlignedBuffer<std::int16_t>  nstmFeatures;
+        AlignedBuffer<std::uint8_t>  stm;
+        AlignedBuffer<float>         eval;
+        AlignedBuffer<float>         wdl;
+
+        void allocate(const std::size_t capacity) {
+            offsets.resize(capacity + 1);
+            stmFeatures.resize(capacity * MAX_FEATURES);
+            nstmFeatures.resize(capacity * MAX_FEATURES);
+            stm.resize(capacity);
+            eval.resize(capacity);
+            wdl.resize(capacity);
+            clear();
+        }
+
+        void clear() {
+            size       = 0;
+            offsets[0] = 0;
+        }
+
+        // Appends the position's features and targets
+        void add(const DataSetEntry& entry);
+
+        // Copy of the first `count` positions into `into` for the checkpoint
+        // writer to make along with the files, allocate() enough capacity first
+        FileSnapshot snapshot(Batch& into, std::size_t count) const;
+
+        int featureCount(const std::size_t i) const {
+            return offsets[i + 1] - offsets[i];
+        }
+    };
+
+    // Number of batches in flight between the producers and the trainer
+    constexpr std::size_t BATCH_QUEUE_DEPTH = 16;
+
+    // Mixed chunk buffers: one being mixed, the ready one, the one being
+    // sliced and the previous one while the last batches featurize from it
+    constexpr std::size_t CHUNK_POOL_SIZE = 4;
+
+    // The positions of one binpack chunk or cache block that passed the
+    // filters, with the index of each among all positions of the chunk.
+    // Pieces are numbered as they are claimed and enter the decoded stream
+    // in that order, whichever decoder finishes first.
+    struct Piece {
+        std::uint64_t              sequence = 0;
+        std::size_t                file     = 0;
+        std::uint64_t              position = 0; // binpack chunk or cache block step
+        std::vector<Cursor>        before;       // every file's cursor when it was claimed
+        std::vector<DataSetEntry>  entries;
+        std::vector<std::uint32_t> raw;
+        std::size_t                used = 0; // entries already in the stream
+    };
+
+    // Where the mixed stream continues: the seed and window it was mixed
+    // with, the mixed chunk the trainer is in and the positions of it that
+    // were trained on. The files continue at DataSetLoader::cursors().
+    struct StreamCursor {
+        std::uint64_t seed   = 0;
+        std::uint64_t window = 0; // decoded chunks per mixed chunk
+        std::uint64_t chunk  = 0;
+        std::uint64_t entry  = 0;
+    };
+
     struct DataSetLoader {
-        std::array<DataSetEntry, CHUNK_SIZE> currentData;
-        std::array<DataSetEntry, CHUNK_SIZE> nextData;
-        std::array<int, CHUNK_SIZE>            permuteShuffle;
+        CacheFile   cache;
+        std::string path; // see parseDataSet()
+        std::size_t batchSize       = 16384;
+        int         decoderThreads  = 4;
+        int         producerThreads = 2;
+        bool        useMmap         = true;
+
+        // Chunk buffers are allocated once. A buffer goes back to freeChunks
+        // when the last batch slicing it lets go, declared before the chunks
+        // handed out so it outlives them.
+        std::vector<DecodedChunk>  chunkPool;
+        std::vector<DecodedChunk*> freeChunks;
+        std::mutex                 poolMutex;
+        std::condition_variable    poolCondition;
+
+        // The reading thread decodes and mixes whole chunks on the decoder
+        // pool and hands them over one at a time
+        std::unique_ptr<ThreadPool>   decoders;
+        std::thread                   readingThread;
+        std::mutex                    chunkMutex;
+        std::condition_variable       chunkCondition;
+        std::shared_ptr<DecodedChunk> readyChunk;
+
+        // Chunk the producers are currently slicing into batches. Batches
+        // are published in the order their positions were claimed, so the
+        // batches handed out always cover a prefix of the stream.
+        std::mutex                    claimMutex;
+        std::shared_ptr<DecodedChunk> currentChunk;
+        std::size_t                   chunkOffset = 0;
+        std::uint64_t                 tickets     = 0;
+        std::atomic<std::uint64_t>    published{0};
+        std::atomic<std::uint64_t>    handedOut{0}; // positions
+
+        // Producers fill free batches and push them to the ready queue, the
+        // trainer hands them back once it's done with them
+        std::vector<Batch>       batches;
+        BoundedQueue<Batch*>     freeBatches{BATCH_QUEUE_DEPTH};
+        BoundedQueue<Batch*>     readyBatches{BATCH_QUEUE_DEPTH};
+        Batch*                   current = nullptr;
+        std::vector<std::thread> producers;
+        std::atomic<bool>        stopping{false};
+
+        // Set with stopping when a source can't be read, batches acquired
+        // afterwards are null
+        std::atomic<bool> failed{false};
+
+        // Binpack files of the dataset. Decoders take their next chunk from
+        // the file furthest behind its share of the positions drawn so far.
+        std::vector<std::unique_ptr<ChunkSource>> sources;
+        std::vector<double>                       weights;
+        std::mutex                                scheduleMutex;
+        std::uint64_t                             claimed = 0; // pieces
+
+        // Blocks read from the training cache so far
+        std::atomic<std::uint64_t> cacheStep{0};
+
+        // Decoders commit their pieces to the decoded chunk being filled in
+        // claim order. Pieces claimed past its end wait in `carried` for the
+        // next one.
+        std::mutex              commitMutex;
+        std::condition_variable commitCondition;
+        std::uint64_t           committed    = 0;
+        std::deque<Piece>       carried;
+        DecodedChunk*           filling      = nullptr;
+        std::uint64_t           fillingIndex = 0;
+        std::size_t             filled       = 0;
+        bool                    readFailed   = false;
+
+        // Files' cursors at the start of every decoded chunk the trainer
+        // can still be in
+        std::map<std::uint64_t, std::vector<Cursor>> chunkStarts;
+        mutable std::mutex                           startsMutex;
 
-        binpack::CompressedTrainingDataEntryReader reader;
-        std::string                                path;
-        std::size_t batchSize     = 16384;
-        std::size_t positionIndex = 0;
+        // Where init() starts reading in every file, see cursors(). A
+        // position count from skipPositions() is turned into cursors once
+        // the files are open.
+        std::vector<Cursor> startCursors;
+        std::uint64_t       startPosition = 0;
 
-        std::thread readingThread;
+        // The last W = reservoirSize / CHUNK_SIZE decoded chunks. Decoded
+        // chunk d is cut into W slices and slice j goes to mixed chunk d - j,
+        // so mixed chunk o gathers one slice of each of the decoded chunks
+        // o .. o + W - 1 in an order drawn from the seed. Every position is
+        // handed out once, and the stream from mixed chunk o on only depends
+        // on the files' cursors at the start of decoded chunk o. A fresh run
+        // leaves out the slices that would belong to mixed chunks before its
+        // first one.
+        std::vector<DecodedChunk>  window;
+        std::vector<std::uint32_t> order;
+        std::size_t                reservoirSize = 4 * CHUNK_SIZE;
+        std::uint64_t              seed          = std::random_device{}();
 
+        // Mixed chunk and position of it where init() starts, see streamCursor()
+        std::uint64_t firstChunk = 0;
+        std::size_t   firstEntry = 0;
 
-        DataSetLoader(const std::string& _path) : reader{_path}, path{_path} {
-            init();
+        // Run in the decoder threads, every piece has its own random stream
+        // for the skip filter
+        FilterChain    filters;
+        FilterCounters filterCounters;
+
+        // Counters since the last call to stats()
+        std::atomic<std::uint64_t> trainerStallNs{0};
+        std::atomic<std::uint64_t> producerStallNs{0};
+        std::atomic<std::uint64_t> batchesConsumed{0};
+        std::atomic<std::uint64_t> queueDepthSum{0};
+
+        DataSetLoader(const std::string& _path) : path{_path} {
         }
 
-        DataSetLoader(const std::string& _path, const std::size_t _batchSize) : reader{_path}, path{_path}, batchSize{_batchSize} {
-            init();
-            std::cout << "Loaded " << _path << " with batch size " << _batchSize << std::endl;
+        DataSetLoader(const std::string& _path, const std::size_t _batchSize) : path{_path}, batchSize{std::min(_batchSize, CHUNK_SIZE)} {
+            if (_batchSize > CHUNK_SIZE) {
+                std::cout << "Batch size " << _batchSize << " is larger than the chunk size, using " << CHUNK_SIZE << std::endl;
+            }
         }
 
-        void          loadNext();
+        ~DataSetLoader();
+
+        // Fills decoded chunk `index`, false if the sources ran dry before it was full
+        bool          loadNext(DecodedChunk& chunk, std::uint64_t index);
         void          loadNextBatch();
-        void          init();
-        void          shuffle();
-        DataSetEntry& getEntry(const int index) {
-            return currentData[positionIndex + index];
+
+        // For consumers that hold batches of their own instead of `current`
+        Batch*        acquireBatch();
+        void          releaseBatch(Batch* batch);
+
+        bool          takePiece(Piece& piece, Chunk& chunk);
+        void          decodePiece(Piece& piece, const Chunk& chunk, FilterStats& filterStats);
+        bool          append(Piece& piece);
+        std::vector<Cursor> readCursors() const;
+        void          openFiles();
+        void          decodeChunks();
+        void          readChunks();
+        void          produceBatches();
+        bool          fillBatch(Batch& batch, std::uint64_t& ticket);
+        // False if none of the dataset's files can be read
+        bool          init();
+        bool          fillWindow();
+        void          fail();
+        void          wakeAll();
+        std::shared_ptr<DecodedChunk> takeChunk();
+        void          mix(DecodedChunk& chunk, std::uint64_t index);
+        const Batch&  getBatch() const {
+            return *current;
+        }
+
+        bool hasFailed() const {
+            return failed.load();
+        }
+
+        struct Stats {
+            double        averageQueueDepth;
+            std::uint64_t trainerStallMs;
+            std::uint64_t producerStallMs;
+        };
+
+        // Queue depth seen by the trainer and time spent waiting on either side,
+        // resets the counters
+        Stats stats();
+
+        // Stream position after the last batch the trainer took, not
+        // counting `current` which it hasn't trained on yet
+        StreamCursor streamCursor() const;
+
+        // One cursor per file, where the decoded chunk streamCursor() needs
+        // first starts. Resuming there replays the same stream.
+        std::vector<Cursor> cursors() const;
+
+        // Resumes at cursors() and streamCursor(), which also brings back
+        // the seed and the shuffle buffer size. Call before init(), replaces
+        // skipPositions().
+        void setCursors(const std::vector<Cursor>& _cursors, const StreamCursor& stream) {
+            startCursors  = _cursors;
+            startPosition = 0;
+            seed          = stream.seed;
+            reservoirSize = std::max<std::uint64_t>(1, stream.window) * CHUNK_SIZE;
+            firstChunk    = stream.chunk;
+            firstEntry    = std::min<std::uint64_t>(stream.entry, CHUNK_SIZE);
+        }
+
+        // Starts reading every file at its n-th position, before filtering.
+        // For caches positions are records. Call before init().
+        void skipPositions(const std::uint64_t _positions) {
+            startPosition = _positions;
+        }
+
+        void setDecoderThreads(const int _decoderThreads) {
+            decoderThreads = std::max(1, _decoderThreads);
+        }
+
+        void setProducerThreads(const int _producerThreads) {
+            producerThreads = std::max(1, _producerThreads);
+        }
+
+        // Positions in the shuffle buffer, rounded up to whole chunks
+        void setShuffleBuffer(const std::size_t _positions) {
+            reservoirSize = std::max<std::size_t>(1, (_positions + CHUNK_SIZE - 1) / CHUNK_SIZE) * CHUNK_SIZE;
+        }
+
+        void setSeed(const std::uint64_t _seed) {
+            seed = _seed;
+        }
+
+        void setMmap(const bool _useMmap) {
+            useMmap = _useMmap;
+        }
+
+        void setFilters(const FilterChain& _filters) {
+            filters = _filters;
+        }
+
+        // Positions the filters saw and rejected since the last call, resets the counts
+        FilterStats filterStats() {
+            return filterCounters.take();
         }
     };
 
@@ -0,0 +1,99 @@
+#include "datasetspec.h"
+
+#include <algorithm>
+#include <cstdlib>
+#include <filesystem>
+#include <iostream>
+#include <sstream>
+
+namespace DataLoader {
+
+    namespace {
+        bool matches(const char* pattern, const char* name) {
+            for (; *pattern; ++pattern, ++name) {
+                if (*pattern == '*') {
+                    for (const char* rest = name;; ++rest) {
+                        if (matches(pattern + 1, rest)) {
+                            return true;
+                        }
+                        if (!*rest) {
+                            return false;
+                        }
+                    }
+                }
+
+                if (!*name || (*pattern != '?' && *pattern != *name)) {
+                    return false;
+                }
+            }
+
+            return !*name;
+        }
+
+        // Files matching the wildcards in the file name, sorted so the order doesn't depend on the file system
+        std::vector<std::string> expand(const std::string& path) {
+            const std::filesystem::path pattern(path);
+            const std::string           name = pattern.filename().string();
+
+            if (name.find_first_of("*?") == std::string::npos) {
+                return {path};
+            }
+
+            const std::filesystem::path directory = pattern.has_parent_path() ? pattern.parent_path() : std::filesystem::path(".");
+
+            std::vector<std::string> found;
+            std::error_code          error;
+
+            for (const auto& entry : std::filesystem::directory_iterator(directory, error)) {
+                if (entry.is_regular_file() && matches(name.c_str(), entry.path().filename().string().c_str())) {
+                    found.push_back(entry.path().string());
+                }
+            }
+
+            std::sort(found.begin(), found.end());
+            return found;
+        }
+    } // namespace
+
+    std::vector<DataSetFile> parseDataSet(const std::string& spec) {
+        std::vector<DataSetFile> files;
+        std::stringstream        entries(spec);
+
+        for (std::string entry; std::getline(entries, entry, ',');) {
+            if (entry.empty()) {
+                continue;
+            }
+
+            // Only a number after the last colon is a weight, so Windows drive letters still work
+            double            weight = 1.0;
+            const std::size_t colon  = entry.rfind(':');
+
+            if (colon != std::string::npos && colon + 1 < entry.size()) {
+                char*        end;
+                const double value = std::strtod(entry.c_str() + colon + 1, &end);
+
+                if (*end == '\0') {
+                    if (value <= 0) {
+                        std::cout << "Dataset " << entry << " has no positive weight, leaving it out" << std::endl;
+                        continue;
+                    }
+
+                    weight = value;
+                    entry.resize(colon);
+                }
+            }
+
+            const std::vector<std::string> paths = expand(entry);
+            if (paths.empty()) {
+                std::cout << "Dataset " << entry << " matches no files" << std::endl;
+            }
+
+            for (const std::string& path : paths) {
+                files.push_back({path, weight});
+            }
+        }
+
+        return files;
+    }
+
+} // namespace DataLoader
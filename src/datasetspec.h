@@ -0,0 +1,20 @@
+#pragma once
+
+#include <string>
+#include <vector>
+
+namespace DataLoader {
+
+    // One file of a mixed dataset. The weight is its share of the positions
+    // the loader reads, relative to the other files.
+    struct DataSetFile {
+        std::string path;
+        double      weight = 1.0;
+    };
+
+    // Parses a comma separated list of `path[:weight]`. The file name part of
+    // a path may hold * and ? wildcards, every match gets the entry's weight.
+    // Entries that match no file are reported and left out.
+    std::vector<DataSetFile> parseDataSet(const std::string& spec);
+
+} // namespace DataLoader
@@ -0,0 +1,140 @@
+#include "filter.h"
+
+#include <cstdlib>
+#include <iostream>
+#include <sstream>
+
+namespace DataLoader {
+
+    namespace {
+        bool parseInt(const std::string& text, int& value) {
+            char*      end;
+            const long parsed = std::strtol(text.c_str(), &end, 10);
+
+            if (text.empty() || *end != '\0') {
+                return false;
+            }
+
+            value = static_cast<int>(parsed);
+            return true;
+        }
+
+        // "lo..hi" with either end optional, or a single value for both
+        bool parseRange(const std::string& text, int& lo, int& hi) {
+            const std::size_t dots = text.find("..");
+
+            if (dots == std::string::npos) {
+                return parseInt(text, lo) && parseInt(text, hi);
+            }
+
+            const std::string low  = text.substr(0, dots);
+            const std::string high = text.substr(dots + 2);
+
+            return (low.empty() || parseInt(low, lo)) && (high.empty() || parseInt(high, hi));
+        }
+    } // namespace
+
+    const char* filterName(const Filter filter) {
+        switch (filter) {
+            case Filter::Unscored:
+                return "unscored";
+            case Filter::Ply:
+                return "ply";
+            case Filter::Score:
+                return "score";
+            case Filter::Random:
+                return "skip";
+            case Filter::Pieces:
+                return "pieces";
+            case Filter::Capture:
+                return "capture";
+            case Filter::Check:
+                return "check";
+        }
+        return "?";
+    }
+
+    void FilterCounters::add(FilterStats& stats) {
+        seen.fetch_add(stats.seen, std::memory_order_relaxed);
+        for (std::size_t i = 0; i < FILTER_COUNT; ++i) {
+            rejected[i].fetch_add(stats.rejected[i], std::memory_order_relaxed);
+        }
+
+        stats = {};
+    }
+
+    FilterStats FilterCounters::take() {
+        FilterStats stats;
+
+        stats.seen = seen.exchange(0);
+        for (std::size_t i = 0; i < FILTER_COUNT; ++i) {
+            stats.rejected[i] = rejected[i].exchange(0);
+        }
+
+        return stats;
+    }
+
+    bool FilterChain::parse(const std::string& spec) {
+        FilterChain chain;
+        chain.minPly       = 0;
+        chain.dropCaptures = false;
+        chain.dropChecks   = false;
+
+        std::stringstream items(spec);
+
+        for (std::string item; std::getline(items, item, ',');) {
+            const std::size_t equals = item.find('=');
+            const std::string name   = item.substr(0, equals);
+            const std::string value  = equals == std::string::npos ? "" : item.substr(equals + 1);
+
+            bool ok = true;
+
+            if (name == "ply") {
+                ok = parseRange(value, chain.minPly, chain.maxPly);
+            } else if (name == "score") {
+                // Only the magnitude is limited, "..N" and "N" both mean |score| <= N
+                int lo = 0;
+                ok     = parseRange(value, lo, chain.maxScore) && chain.maxScore >= 0;
+            } else if (name == "pieces") {
+                ok = parseRange(value, chain.minPieces, chain.maxPieces);
+            } else if (name == "skip") {
+                char* end;
+                chain.skipProbability = std::strtod(value.c_str(), &end);
+                ok                    = !value.empty() && *end == '\0' && chain.skipProbability >= 0 && chain.skipProbability < 1;
+            } else if (name == "capture" && value.empty()) {
+                chain.dropCaptures = true;
+            } else if (name == "check" && value.empty()) {
+                chain.dropChecks = true;
+            } else if (name != "none") {
+                ok = false;
+            }
+
+            if (!ok) {
+                std::cout << "Couldn't parse filter " << item << " in " << spec << std::endl;
+                return false;
+            }
+        }
+
+        *this = chain;
+        return true;
+    }
+
+    std::string FilterChain::describe() const {
+        std::stringstream out;
+
+        out << "ply " << minPly << ".." << maxPly << ", |score| <= " << maxScore << ", pieces " << minPieces << ".." << maxPieces;
+
+        if (skipProbability > 0) {
+            out << ", skip " << skipProbability;
+        }
+        if (dropCaptures) {
+            out << ", no captures";
+        }
+        if (dropChecks) {
+            out << ", no checks";
+        }
+
+        return out.str();
+    }
+
+} // namespace DataLoader
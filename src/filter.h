@@ -0,0 +1,128 @@
+#pragma once
+
+#include "packedentry.h"
+#include "random.h"
+
+#include <array>
+#include <atomic>
+#include <cstdint>
+#include <string>
+
+namespace DataLoader {
+
+    // Filters in the order they run, cheapest first: plain fields of the
+    // entry, then the random skip, then predicates that look at the board
+    enum class Filter : std::uint8_t {
+        Unscored,
+        Ply,
+        Score,
+        Random,
+        Pieces,
+        Capture,
+        Check,
+    };
+
+    constexpr std::size_t FILTER_COUNT = 7;
+
+    const char* filterName(Filter filter);
+
+    // Per thread reject counts, merged into FilterCounters once per chunk
+    struct FilterStats {
+        std::uint64_t                           seen = 0;
+        std::array<std::uint64_t, FILTER_COUNT> rejected{};
+    };
+
+    struct FilterCounters {
+        std::atomic<std::uint64_t>                           seen{0};
+        std::array<std::atomic<std::uint64_t>, FILTER_COUNT> rejected{};
+
+        void add(FilterStats& stats);
+
+        // Reject counts since the last call, resets the counters
+        FilterStats take();
+    };
+
+    // Declarative chain of position filters. Every filter is off unless set,
+    // the defaults match the trainer's historic filtering. Positions without
+    // a score (32002) are always dropped.
+    struct FilterChain {
+        int    minPly          = 17;
+        int    maxPly          = 65535;
+        int    maxScore        = 32001; // largest |score| kept
+        int    minPieces       = 2;
+        int    maxPieces       = 32;
+        bool   dropCaptures    = true;
+        bool   dropChecks      = true;
+        double skipProbability = 0;
+
+        // Comma separated list, for example "ply=17..,score=..3000,pieces=6..,capture,check,skip=0.25".
+        // Ranges are lo..hi with either end optional, filters left out are off.
+        // Returns false and leaves the chain alone if the spec doesn't parse.
+        bool parse(const std::string& spec);
+
+        std::string describe() const;
+
+        // Runs on a decoded binpack entry
+        bool accept(const binpack::TrainingDataEntry& entry, Random& random, FilterStats& stats) const {
+            stats.seen++;
+
+            if (entry.score == 32002) {
+                return reject(Filter::Unscored, stats);
+            }
+            if (entry.ply < minPly || entry.ply > maxPly) {
+                return reject(Filter::Ply, stats);
+            }
+            if (entry.score > maxScore || entry.score < -maxScore) {
+                return reject(Filter::Score, stats);
+            }
+            if (skipProbability > 0 && random.uniform() < skipProbability) {
+                return reject(Filter::Random, stats);
+            }
+            if (minPieces > 2 || maxPieces < 32) {
+                const int pieces = entry.pos.piecesBB().count();
+                if (pieces < minPieces || pieces > maxPieces) {
+                    return reject(Filter::Pieces, stats);
+                }
+            }
+            if (dropCaptures && entry.isCapturingMove()) {
+                return reject(Filter::Capture, stats);
+            }
+            if (dropChecks && entry.isInCheck()) {
+                return reject(Filter::Check, stats);
+            }
+
+            return true;
+        }
+
+        // Runs on a cached record, which was filtered for captures and checks
+        // when the cache was built and has no move to test anymore
+        bool accept(const PackedEntry& entry, Random& random, FilterStats& stats) const {
+            stats.seen++;
+
+            if (entry.ply < minPly || entry.ply > maxPly) {
+                return reject(Filter::Ply, stats);
+            }
+            if (entry.score > maxScore || entry.score < -maxScore) {
+                return reject(Filter::Score, stats);
+            }
+            if (skipProbability > 0 && random.uniform() < skipProbability) {
+                return reject(Filter::Random, stats);
+            }
+            if (minPieces > 2 || maxPieces < 32) {
+                const int pieces = std::popcount(entry.occupancy);
+                if (pieces < minPieces || pieces > maxPieces) {
+                    return reject(Filter::Pieces, stats);
+                }
+            }
+
+            return true;
+        }
+
+    private:
+        static bool reject(const Filter filter, FilterStats& stats) {
+            stats.rejected[static_cast<std::size_t>(filter)]++;
+            return false;
+        }
+    };
+
+} // namespace DataLoader
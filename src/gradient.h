@@ -1,49 +1,209 @@
 #pragma once
 
+#include "alignedbuffer.h"
+#include "half.h"
+#include "optimizer.h"
 #include "types.h"
 #include <array>
+#include <cstddef>
 #include <cstring>
+#include <vector>
 
-struct Gradient {
-    float M = 0;
-    float V = 0;
+// Optimizer state of one layer, first and second moments in separate
+// aligned arrays so the update kernels stream through them. Elements are
+// fp32, bf16 or fp16 depending on the storage.
+struct Moments {
+    std::size_t              size;
+    MomentStorage            storage = MomentStorage::FP32;
+    AlignedBuffer<std::byte> M;
+    AlignedBuffer<std::byte> V;
+
+    explicit Moments(const std::size_t n) : size(n) {
+        setStorage(MomentStorage::FP32);
+    }
+
+    // Reallocates, the moments start over at zero
+    void setStorage(const MomentStorage _storage) {
+        storage = _storage;
+        M.resize(size * elementSize());
+        V.resize(size * elementSize());
+    }
+
+    std::size_t elementSize() const {
+        return storage == MomentStorage::FP32 ? sizeof(float) : sizeof(std::uint16_t);
+    }
+
+    void* m(const std::size_t offset) {
+        return M.data() + offset * elementSize();
+    }
+    void* v(const std::size_t offset) {
+        return V.data() + offset * elementSize();
+    }
+
+    // Converts elements [offset, offset + n) to fp32 and back
+    void read(const std::size_t offset, const int n, float* m, float* v) const {
+        for (int i = 0; i < n; ++i) {
+            m[i] = get(M, offset + i);
+            v[i] = get(V, offset + i);
+        }
+    }
+    void write(const std::size_t offset, const int n, const float* m, const float* v) {
+        for (int i = 0; i < n; ++i) {
+            set(M, offset + i, m[i]);
+            set(V, offset + i, v[i]);
+        }
+    }
+
+    static float element(const MomentStorage _storage, const std::byte* moments, const std::size_t i) {
+        if (_storage == MomentStorage::FP32) {
+            return reinterpret_cast<const float*>(moments)[i];
+        }
+
+        const std::uint16_t h = reinterpret_cast<const std::uint16_t*>(moments)[i];
+        return _storage == MomentStorage::BF16 ? bf16ToFloat(h) : fp16ToFloat(h);
+    }
+
+    float get(const AlignedBuffer<std::byte>& moments, const std::size_t i) const {
+        return element(storage, moments.data(), i);
+    }
+
+    // Copies moments kept in another precision, converting them if needed
+    void assign(const MomentStorage from, const std::byte* m, const std::byte* v) {
+        if (from == storage) {
+            std::memcpy(M.data(), m, M.size());
+            std::memcpy(V.data(), v, V.size());
+            return;
+        }
+
+        for (std::size_t i = 0; i < size; ++i) {
+            set(M, i, element(from, m, i));
+            set(V, i, element(from, v, i));
+        }
+    }
+
+    void set(AlignedBuffer<std::byte>& moments, const std::size_t i, const float x) {
+        if (storage == MomentStorage::FP32) {
+            reinterpret_cast<float*>(moments.data())[i] = x;
+        } else {
+            reinterpret_cast<std::uint16_t*>(moments.data())[i] = storage == MomentStorage::BF16 ? floatToBf16(x) : floatToFp16(x);
+        }
+    }
 
     void clear() {
-        M = 0;
-        V = 0;
+        std::memset(M.data(), 0, M.size());
+        std::memset(V.data(), 0, V.size());
     }
 };
 
 struct NNGradients {
-    std::array<Gradient, INPUT_SIZE * HIDDEN_SIZE> inputFeatures;
-    std::array<Gradient, HIDDEN_SIZE>              inputBias;
-    std::array<Gradient, HIDDEN_SIZE * 2>          hiddenFeatures;
-    std::array<Gradient, OUTPUT_SIZE>              hiddenBias;
+    Moments inputFeatures{INPUT_SIZE * HIDDEN_SIZE};
+    Moments inputBias{HIDDEN_SIZE};
+    Moments hiddenFeatures{HIDDEN_SIZE * 2};
+    Moments hiddenBias{OUTPUT_SIZE};
+
+    // Lazy bookkeeping: optimizer step count and the step at which
+    // each input feature row was last brought up to date.
+    std::uint64_t                         step = 0;
+    std::array<std::uint64_t, INPUT_SIZE> rowSteps;
 
     NNGradients() {
         clear();
     }
 
+    void setStorage(const MomentStorage storage) {
+        for (Moments* moments : layers()) {
+            moments->setStorage(storage);
+        }
+        clear();
+    }
+
+    std::array<Moments*, 4> layers() {
+        return {&inputFeatures, &inputBias, &hiddenFeatures, &hiddenBias};
+    }
+
     void clear() {
-        std::memset(inputFeatures.data(), 0, sizeof(Gradient) * INPUT_SIZE * HIDDEN_SIZE);
-        std::memset(inputBias.data(), 0, sizeof(Gradient) * HIDDEN_SIZE);
-        std::memset(hiddenFeatures.data(), 0, sizeof(Gradient) * HIDDEN_SIZE * 2);
-        std::memset(hiddenBias.data(), 0, sizeof(Gradient) * OUTPUT_SIZE);
+        step = 0;
+        rowSteps.fill(0);
+        for (Moments* moments : layers()) {
+            moments->clear();
+        }
     }
 };
 
+// Arrays start on cache lines, see Trainer::columnRange. The input feature
+// gradient is only allocated for the threads that scatter into it.
 struct BatchGradients {
-    std::array<float, INPUT_SIZE * HIDDEN_SIZE> inputFeatures;
-    std::array<float, HIDDEN_SIZE>              inputBias;
-    std::array<float, HIDDEN_SIZE * 2>          hiddenFeatures;
-    std::array<float, OUTPUT_SIZE>              hiddenBias;
+    AlignedBuffer<float>                           inputFeatures;
+    alignas(64) std::array<float, HIDDEN_SIZE>     inputBias;
+    alignas(64) std::array<float, HIDDEN_SIZE * 2> hiddenFeatures;
+    alignas(64) std::array<float, OUTPUT_SIZE>     hiddenBias;
+
+    // Input feature rows touched since the last reduction, so only those
+    // rows have to be reduced and cleared.
+    std::array<bool, INPUT_SIZE> activeRows;
 
     BatchGradients() {
         clear();
     }
 
-    void clear(){
-        std::memset(inputFeatures.data(), 0, sizeof(float) * INPUT_SIZE * HIDDEN_SIZE);
+    // Allocates or frees the input feature gradient, which starts at zero
+    void setInputGradient(const bool needed) {
+        const std::size_t size = needed ? INPUT_SIZE * HIDDEN_SIZE : 0;
+        if (inputFeatures.size() != size) {
+            inputFeatures.resize(size);
+        }
+    }
+
+    void markActive(const int feature) {
+        activeRows[feature] = true;
+    }
+
+    void clear() {
+        std::memset(inputFeatures.data(), 0, sizeof(float) * inputFeatures.size());
+        std::memset(inputBias.data(), 0, sizeof(float) * HIDDEN_SIZE);
+        std::memset(hiddenFeatures.data(), 0, sizeof(float) * HIDDEN_SIZE * 2);
+        std::memset(hiddenBias.data(), 0, sizeof(float) * OUTPUT_SIZE);
+        activeRows.fill(false);
+    }
+};
+
+
+// Gradients of a handful of samples. Input rows get a compact slot the
+// first time they're touched, so only those rows are written and cleared.
+// The slot rows grow to the most rows a micro batch has touched so far.
+struct SparseGradients {
+    std::array<std::int16_t, INPUT_SIZE> slots;
+    std::vector<std::int16_t>            rows;
+    std::vector<float>                   inputFeatures;
+    std::array<float, HIDDEN_SIZE>       inputBias;
+    std::array<float, HIDDEN_SIZE * 2>   hiddenFeatures;
+    std::array<float, OUTPUT_SIZE>       hiddenBias;
+
+    SparseGradients() {
+        slots.fill(-1);
+        rows.reserve(INPUT_SIZE);
+        clear();
+    }
+
+    std::int16_t slot(const int feature) {
+        if (slots[feature] < 0) {
+            slots[feature] = static_cast<std::int16_t>(rows.size());
+            rows.push_back(feature);
+
+            if (inputFeatures.size() < rows.size() * HIDDEN_SIZE) {
+                inputFeatures.resize(rows.size() * HIDDEN_SIZE);
+            }
+        }
+        return slots[feature];
+    }
+
+    void clear() {
+        for (std::size_t i = 0; i < rows.size(); ++i) {
+            std::memset(inputFeatures.data() + i * HIDDEN_SIZE, 0, sizeof(float) * HIDDEN_SIZE);
+            slots[rows[i]] = -1;
+        }
+        rows.clear();
+
         std::memset(inputBias.data(), 0, sizeof(float) * HIDDEN_SIZE);
         std::memset(hiddenFeatures.data(), 0, sizeof(float) * HIDDEN_SIZE * 2);
         std::memset(hiddenBias.data(), 0, sizeof(float) * OUTPUT_SIZE);
@@ -0,0 +1,87 @@
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+
+// Scalar conversions between fp32 and the 16 bit formats the optimizer
+// state can be stored in. Static so the SIMD units get their own copies.
+
+static inline std::uint32_t floatBits(const float x) {
+    std::uint32_t bits;
+    std::memcpy(&bits, &x, sizeof(bits));
+    return bits;
+}
+
+static inline float bitsToFloat(const std::uint32_t bits) {
+    float x;
+    std::memcpy(&x, &bits, sizeof(x));
+    return x;
+}
+
+static inline float bf16ToFloat(const std::uint16_t h) {
+    return bitsToFloat(static_cast<std::uint32_t>(h) << 16);
+}
+
+// Round to nearest even
+static inline std::uint16_t floatToBf16(const float x) {
+    const std::uint32_t bits = floatBits(x);
+    return static_cast<std::uint16_t>((bits + 0x7FFF + ((bits >> 16) & 1)) >> 16);
+}
+
+static inline float fp16ToFloat(const std::uint16_t h) {
+    const std::uint32_t sign     = static_cast<std::uint32_t>(h & 0x8000) << 16;
+    const std::uint32_t exponent = (h >> 10) & 0x1F;
+    const std::uint32_t mantissa = h & 0x3FF;
+
+    if (exponent == 0) {
+        // Subnormal, mantissa * 2^-24
+        const float value = static_cast<float>(mantissa) * 5.9604645e-8f;
+        return sign ? -value : value;
+    }
+    if (exponent == 31) {
+        return bitsToFloat(sign | 0x7F800000 | (mantissa << 13));
+    }
+    return bitsToFloat(sign | ((exponent + 112) << 23) | (mantissa << 13));
+}
+
+// Round toward zero, out of range values become infinity
+static inline std::uint16_t floatToFp16Truncate(const float x) {
+    const std::uint32_t bits      = floatBits(x);
+    const std::uint16_t sign      = (bits >> 16) & 0x8000;
+    const std::uint32_t magnitude = bits & 0x7FFFFFFF;
+
+    if (magnitude >= 0x47800000) {
+        return sign | 0x7C00;
+    }
+    if (magnitude < 0x38800000) {
+        // Below the smallest normal, shift the full mantissa into a subnormal
+        const int shift = 126 - static_cast<int>(magnitude >> 23);
+        if (shift > 24) {
+            return sign;
+        }
+        return sign | static_cast<std::uint16_t>(((magnitude & 0x7FFFFF) | 0x800000) >> shift);
+    }
+    return sign | static_cast<std::uint16_t>((magnitude - 0x38000000) >> 13);
+}
+
+// Rounds up with a probability equal to the distance from the truncated
+// value, `random` supplies the 24 bits used for the decision
+static inline std::uint16_t floatToFp16Stochastic(const float x, const std::uint32_t random) {
+    const std::uint16_t truncated = floatToFp16Truncate(x);
+
+    if ((truncated & 0x7FFF) >= 0x7C00) {
+        return truncated;
+    }
+
+    const float magnitude = x < 0 ? -x : x;
+    const float lower     = fp16ToFloat(truncated & 0x7FFF);
+    const float upper     = fp16ToFloat((truncated & 0x7FFF) + 1);
+
+    const float probability = (magnitude - lower) / (upper - lower);
+    return static_cast<float>(random >> 8) * 5.9604645e-8f < probability ? truncated + 1 : truncated;
+}
+
+// Round to nearest
+static inline std::uint16_t floatToFp16(const float x) {
+    return floatToFp16Stochastic(x, 0x80000000u);
+}
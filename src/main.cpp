@@ -1,13 +1,15 @@
 #include "argparse.h"
+#include "bench.h"
+#include "simd.h"
 #include "trainer.h"
 
-#include <omp.h>
+#include <random>
 #include <sstream>
 
 int main(int argc, char* argv[]) {
     ArgumentParser parser;
-    parser.addArgument("--dataset", "Path to the dataset.");
-    parser.addArgument("--epochs", "Number of epochs to train for.");
+    parser.addArgument("--dataset", "Path to the dataset, or a comma separated list of binpacks as path[:weight] to mix them by weight. Wildcards in file names match several files. The first run over a binpack writes a chunk index next to it as <path>.idx, which decodes the whole file once on the decoder threads.");
+    parser.addArgument("--epochs", "Number of epochs to train for.", true);
     parser.addArgument("--id", "Network ID. Leave for random. Use '$' for a random number placeholder.", true);
     parser.addArgument("--lr", "Learning rate. (Default 0.001)", true);
     parser.addArgument("--lr-interval", "LR scheduler intervals. (Default 50)", true);
@@ -15,6 +17,39 @@ int main(int argc, char* argv[]) {
     parser.addArgument("--checkpoint", "Path to the checkpoint to load from.", true);
     parser.addArgument("--savepath", "Path to where checkpoints will be saved.", true);
     parser.addArgument("--saveinterval", "Interval for saving checkpoints.", true);
+    parser.addArgument("--sparse-input", "Only update input rows that were active in the batch. (Default 0)", true);
+    parser.addArgument("--threads", "Number of training threads. (Default: all cores)", true);
+    parser.addArgument("--pin-threads", "Pin every training thread but the first to a CPU of its own, within the CPUs the process may run on. The loader threads aren't pinned and share them. (Default 0)", true);
+    parser.addArgument("--batch-size", "Positions per batch. (Default 16384)", true);
+    parser.addArgument("--epoch-size", "Positions per epoch (superbatch). (Default 1000000000)", true);
+    parser.addArgument("--decoders", "Number of binpack decoder threads. (Default 4)", true);
+    parser.addArgument("--producers", "Number of threads assembling batches ahead of the trainer. (Default 2)", true);
+    parser.addArgument("--mmap", "Memory map the dataset instead of streaming it. (Default 1)", true);
+    parser.addArgument("--dataset-skip", "Start reading the dataset after this many positions, counted before filtering, e.g. to shard it or hold out a validation split. A resumed checkpoint's own position takes precedence. (Default 0)", true);
+    parser.addArgument("--shuffle-buffer", "Positions kept in the shuffle buffer, rounded up to whole 1M chunks. Every chunk handed to the trainer takes an equal slice of each decoded chunk in the buffer. A checkpoint resumes with its own buffer and seed. (Default 4194304)", true);
+    parser.addArgument("--shuffle-seed", "Seed of the shuffle and the random skip filter. (Default: random)", true);
+    parser.addArgument("--filter", "Position filters, cheapest first: ply=lo..hi, score=..max (magnitude), pieces=lo..hi, skip=probability, capture, check, or none. Caches are built with them, capture and check can't be undone afterwards. (Default ply=17..,capture,check)", true);
+    parser.addArgument("--convert-cache", "Filter and featurize the dataset once into a training cache at this path, then exit.", true);
+    parser.addArgument("--simd", "Force a SIMD kernel set: avx512, avx2 or sse2. (Default: best supported)", true);
+    parser.addArgument("--backward", "Input layer backward pass with --partition samples: scatter or feature-major. (Default scatter)", true);
+    parser.addArgument("--partition", "Split batches between threads by samples or by hidden columns. (Default samples)", true);
+    parser.addArgument("--hogwild", "Asynchronous updates, every thread takes its own batches and updates the weights without locks. Ignores --partition, --backward and --lazy-adam. (Default 0)", true);
+    parser.addArgument("--optimizer", "Optimizer: sgd, momentum, adam, adamw or adamax. (Default adam)", true);
+    parser.addArgument("--weight-decay", "Decoupled weight decay used by adamw. (Default 0.01)", true);
+    parser.addArgument("--moments", "Precision of the optimizer moments: fp32, bf16 or fp16. (Default fp32)", true);
+    parser.addArgument("--mixed-precision", "Keep a bf16 copy of the input weights for the forward pass, the optimizer updates the fp32 weights. (Default 0)", true);
+    parser.addArgument("--qat", "Quantization aware training, the forward pass runs on the weights rounded to the engine's int16 format. (Default 0)", true);
+    parser.addArgument("--qa", "Scale of the quantized input weights and accumulators. (Default 255)", true);
+    parser.addArgument("--qb", "Scale of the quantized output weights. (Default 64)", true);
+    parser.addArgument("--async-save", "Write checkpoints from a background thread while training continues. (Default 1)", true);
+    parser.addArgument("--save-optimizer", "Save the optimizer state in every checkpoint. (Default 1)", true);
+    parser.addArgument("--qclip-input", "Clip input weights to this magnitude in the quantized net, 0 only clips at the int16 range. (Default 0)", true);
+    parser.addArgument("--qclip-output", "Clip output weights to this magnitude in the quantized net, 0 only clips at the integer range. (Default 0)", true);
+    parser.addArgument("--qoutput-int8", "Store the quantized output weights as int8 instead of int16. (Default 0)", true);
+    parser.addArgument("--export-interleave", "Write the quantized input layer in the column order of AVX2 16 bit packing. (Default 0)", true);
+    parser.addArgument("--export-verify", "Positions compared between the float and the quantized net on every save. (Default 1024)", true);
+    parser.addArgument("--bench", "Train this many batches in fp32 and with --mixed-precision from the same network, compare speed and loss, then exit.", true);
+    parser.addArgument("--lazy-adam", "Lazy optimizer updates for input rows, skipped steps are caught up exactly when a row is next touched. (Default 0)", true);
     parser.setProgramName(argv[0]);
 
     // Print help and exit if no arguments or --help flag provided
@@ -37,30 +72,166 @@ int main(int argc, char* argv[]) {
     int         lrInterval     = parser.getArgumentValue("--lr-interval").empty() ? 50 : std::stoi(parser.getArgumentValue("--lr-interval"));
     float       lr             = parser.getArgumentValue("--lr").empty() ? 0.001f : std::stof(parser.getArgumentValue("--lr"));
     float       lrMultiplier   = parser.getArgumentValue("--lr-decay").empty() ? 0.1f : std::stof(parser.getArgumentValue("--lr-decay"));
-    int         epochs         = std::stoi(parser.getArgumentValue("--epochs"));
+    std::string cachePath      = parser.getArgumentValue("--convert-cache");
+    std::string filterArg      = parser.getArgumentValue("--filter");
+    std::size_t shuffleBuffer  = parser.getArgumentValue("--shuffle-buffer").empty() ? 4 * CHUNK_SIZE : std::stoull(parser.getArgumentValue("--shuffle-buffer"));
+    std::size_t shuffleSeed    = parser.getArgumentValue("--shuffle-seed").empty() ? std::random_device{}() : std::stoull(parser.getArgumentValue("--shuffle-seed"));
+    int         threads        = parser.getArgumentValue("--threads").empty() ? std::max(1u, std::thread::hardware_concurrency()) : std::max(1, std::stoi(parser.getArgumentValue("--threads")));
+    bool        pinThreads     = parser.getArgumentValue("--pin-threads").empty() ? false : std::stoi(parser.getArgumentValue("--pin-threads"));
+    std::size_t batchSize      = parser.getArgumentValue("--batch-size").empty() ? 16384 : std::stoull(parser.getArgumentValue("--batch-size"));
+    int         decoders       = parser.getArgumentValue("--decoders").empty() ? 4 : std::stoi(parser.getArgumentValue("--decoders"));
+    int         producers      = parser.getArgumentValue("--producers").empty() ? 2 : std::stoi(parser.getArgumentValue("--producers"));
+    bool        useMmap        = parser.getArgumentValue("--mmap").empty() ? true : std::stoi(parser.getArgumentValue("--mmap"));
+    std::size_t datasetSkip    = parser.getArgumentValue("--dataset-skip").empty() ? 0 : std::stoull(parser.getArgumentValue("--dataset-skip"));
+    std::size_t epochSize      = parser.getArgumentValue("--epoch-size").empty() ? 1000000000 : std::stoull(parser.getArgumentValue("--epoch-size"));
+    bool        sparseInput    = parser.getArgumentValue("--sparse-input").empty() ? false : std::stoi(parser.getArgumentValue("--sparse-input"));
+    bool        lazyAdam       = parser.getArgumentValue("--lazy-adam").empty() ? false : std::stoi(parser.getArgumentValue("--lazy-adam"));
+    std::string backward       = parser.getArgumentValue("--backward");
+    std::string partition      = parser.getArgumentValue("--partition");
+    std::string optimizerArg   = parser.getArgumentValue("--optimizer");
+    std::string momentsArg     = parser.getArgumentValue("--moments");
+    float       weightDecay    = parser.getArgumentValue("--weight-decay").empty() ? 0.01f : std::stof(parser.getArgumentValue("--weight-decay"));
+    bool        hogwild        = parser.getArgumentValue("--hogwild").empty() ? false : std::stoi(parser.getArgumentValue("--hogwild"));
+    bool        mixedPrecision = parser.getArgumentValue("--mixed-precision").empty() ? false : std::stoi(parser.getArgumentValue("--mixed-precision"));
+    bool        qat            = parser.getArgumentValue("--qat").empty() ? false : std::stoi(parser.getArgumentValue("--qat"));
+    int         qa             = parser.getArgumentValue("--qa").empty() ? 255 : std::stoi(parser.getArgumentValue("--qa"));
+    int         qb             = parser.getArgumentValue("--qb").empty() ? 64 : std::stoi(parser.getArgumentValue("--qb"));
+    bool        asyncSave      = parser.getArgumentValue("--async-save").empty() ? true : std::stoi(parser.getArgumentValue("--async-save"));
+    bool        saveOptimizer  = parser.getArgumentValue("--save-optimizer").empty() ? true : std::stoi(parser.getArgumentValue("--save-optimizer"));
+    float       qclipInput     = parser.getArgumentValue("--qclip-input").empty() ? 0.0f : std::stof(parser.getArgumentValue("--qclip-input"));
+    float       qclipOutput    = parser.getArgumentValue("--qclip-output").empty() ? 0.0f : std::stof(parser.getArgumentValue("--qclip-output"));
+    bool        qoutputInt8    = parser.getArgumentValue("--qoutput-int8").empty() ? false : std::stoi(parser.getArgumentValue("--qoutput-int8"));
+    bool        interleave     = parser.getArgumentValue("--export-interleave").empty() ? false : std::stoi(parser.getArgumentValue("--export-interleave"));
+    int         verifyCount    = parser.getArgumentValue("--export-verify").empty() ? 1024 : std::stoi(parser.getArgumentValue("--export-verify"));
+    int         benchBatches   = parser.getArgumentValue("--bench").empty() ? 0 : std::stoi(parser.getArgumentValue("--bench"));
 
-    Trainer* trainer = new Trainer{datasetPath, 16384};
+    // Hogwild only updates the rows a worker touched and keeps no step counts
+    if (hogwild) {
+        lazyAdam = false;
+    }
+
+    // The quantized forward pass doesn't read the bf16 shadow
+    if (qat) {
+        mixedPrecision = false;
+    }
+
+    DataLoader::FilterChain filters;
+    if (!filterArg.empty() && !filters.parse(filterArg)) {
+        std::cout << "Using the default filters" << std::endl;
+    }
+
+    if (!cachePath.empty()) {
+        return DataLoader::convertToCache(datasetPath, cachePath, decoders, filters) ? 0 : 1;
+    }
+
+    if (parser.getArgumentValue("--epochs").empty()) {
+        std::cerr << "Error: Argument --epochs is missing.\n";
+        return 1;
+    }
+
+    int epochs = std::stoi(parser.getArgumentValue("--epochs"));
+
+    Simd::init(parser.getArgumentValue("--simd").c_str());
+
+    Optimizer optimizer = Optimizer::Adam;
+    if (!optimizerArg.empty() && !parseOptimizer(optimizerArg.c_str(), optimizer)) {
+        std::cout << "Unknown optimizer " << optimizerArg << ", using adam" << std::endl;
+    }
+
+    MomentStorage momentStorage = MomentStorage::FP32;
+    if (!momentsArg.empty() && !parseMomentStorage(momentsArg.c_str(), momentStorage)) {
+        std::cout << "Unknown moment precision " << momentsArg << ", using fp32" << std::endl;
+    }
+
+    BackwardMode backwardMode = BackwardMode::Scatter;
+    if (backward == "feature-major") {
+        backwardMode = BackwardMode::FeatureMajor;
+    } else if (!backward.empty() && backward != "scatter") {
+        std::cout << "Unknown backward mode " << backward << ", using scatter" << std::endl;
+    }
+
+    Partition partitionMode = Partition::Samples;
+    if (partition == "hidden") {
+        partitionMode = Partition::Hidden;
+    } else if (!partition.empty() && partition != "samples") {
+        std::cout << "Unknown partition " << partition << ", using samples" << std::endl;
+    }
 
     // Configure trainer
-    trainer->setNetworkId(networkId);
-    trainer->setMaxEpochs(epochs);
-    trainer->setSaveInterval(saveInterval);
-    trainer->setSavePath(savepath);
-    trainer->setLearningRate(lr);
+    const auto configure = [&](Trainer* trainer) {
+        trainer->setNetworkId(networkId);
+        trainer->setMaxEpochs(epochs);
+        trainer->setEpochSize(epochSize);
+        trainer->setDecoderThreads(decoders);
+        trainer->setProducerThreads(producers);
+        trainer->setMmap(useMmap);
+        trainer->setPinThreads(pinThreads);
+        trainer->setDatasetSkip(datasetSkip);
+        trainer->setFilters(filters);
+        trainer->setShuffleBuffer(shuffleBuffer);
+        trainer->setShuffleSeed(shuffleSeed);
+        trainer->setSaveInterval(saveInterval);
+        trainer->setAsyncSave(asyncSave);
+        trainer->setSaveOptimizerState(saveOptimizer);
+        trainer->setSavePath(savepath);
+        trainer->setLearningRate(lr);
+        trainer->setSparseInputGradients(sparseInput);
+        trainer->setLazyAdam(lazyAdam);
+        trainer->setWeightDecay(weightDecay);
+        trainer->setOptimizer(optimizer);
+        trainer->setMomentStorage(momentStorage);
+        trainer->setHogwild(hogwild);
+        trainer->setBackwardMode(backwardMode);
+        trainer->setPartition(partitionMode);
+        trainer->setMixedPrecision(mixedPrecision);
+        trainer->setQuantization(qat, QuantScheme{qa, qb, qclipInput, qclipOutput, qoutputInt8});
+        trainer->setExportInterleave(interleave);
+        trainer->setVerifyPositions(verifyCount);
+    };
+
+    Trainer* trainer = new Trainer{datasetPath, batchSize, threads};
+    configure(trainer);
 
     // Print Configurations
     std::cout << "Dataset Path: " << datasetPath << "\n";
     std::cout << "Checkpoint Path: " << checkpointPath << "\n";
     std::cout << "Save Path: " << savepath << "\n";
+    std::cout << "Async Save: " << asyncSave << " (optimizer state " << saveOptimizer << ")\n";
     std::cout << "Network ID: " << trainer->getNetworkId() << "\n";
     std::cout << "Learning Rate: " << trainer->getLearningRate() << "\n";
-    std::cout << "Number of Available Threads: " << omp_get_max_threads() << "\n";
-    std::cout << "Allocated threads: " << THREADS << "\n";
+    std::cout << "Sparse Input Gradients: " << sparseInput << "\n";
+    std::cout << "Optimizer: " << optimizerName(trainer->getOptimizer()) << "\n";
+    std::cout << "Optimizer Moments: " << momentStorageName(trainer->getMomentStorage()) << "\n";
+    std::cout << "Lazy Adam: " << lazyAdam << "\n";
+    std::cout << "Hogwild: " << hogwild << "\n";
+    std::cout << "Mixed Precision: " << trainer->getMixedPrecision() << "\n";
+    std::cout << "Quantization Aware: " << trainer->getQuantization() << " (QA " << qa << ", QB " << qb << ")\n";
+    std::cout << "Quantized Export: " << (qoutputInt8 ? "int16/int8" : "int16/int16") << (interleave ? " interleaved" : "") << ", verify " << verifyCount << " positions\n";
+    std::cout << "Partition: " << (trainer->getPartition() == Partition::Hidden ? "hidden" : "samples") << "\n";
+    std::cout << "Backward Mode: " << (trainer->getBackwardMode() == BackwardMode::FeatureMajor ? "feature-major" : "scatter") << "\n";
+    std::cout << "SIMD Kernels: " << Simd::kernels().name << "\n";
+    std::cout << "Number of Available Threads: " << std::thread::hardware_concurrency() << "\n";
+    std::cout << "Allocated threads: " << trainer->getThreads() << (pinThreads ? " (pinned)" : "") << "\n";
+    std::cout << "Batch Size: " << trainer->getBatchSize() << "\n";
+    std::cout << "Epoch Size: " << trainer->getEpochSize() << "\n";
+    std::cout << "Decoder Threads: " << decoders << "\n";
+    std::cout << "Producer Threads: " << producers << "\n";
+    std::cout << "Dataset Skip: " << datasetSkip << "\n";
+    std::cout << "Filters: " << filters.describe() << "\n";
+    std::cout << "Shuffle Buffer: " << shuffleBuffer << " (seed " << shuffleSeed << ")\n";
 
     if (!checkpointPath.empty()) {
         trainer->loadCheckpoint(checkpointPath);
     }
-    
+
+    if (benchBatches > 0) {
+        Trainer* mixed = new Trainer{datasetPath, batchSize, threads};
+        configure(mixed);
+
+        benchMixedPrecision(*trainer, *mixed, benchBatches);
+        return 0;
+    }
+
     trainer->train();
 
     return 0;
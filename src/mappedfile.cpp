@@ -0,0 +1,112 @@
+#include "mappedfile.h"
+
+#include <algorithm>
+#include <fstream>
+
+#if defined(__unix__) || defined(__APPLE__)
+    #define HAS_MMAP
+    #include <fcntl.h>
+    #include <sys/mman.h>
+    #include <sys/stat.h>
+    #include <unistd.h>
+#endif
+
+MappedFile::~MappedFile() {
+    close();
+}
+
+bool MappedFile::open(const std::string& path) {
+    close();
+
+#if defined(HAS_MMAP)
+    const int fd = ::open(path.c_str(), O_RDONLY);
+    if (fd < 0) {
+        return false;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size == 0) {
+        ::close(fd);
+        return false;
+    }
+
+    void* address = mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    ::close(fd);
+
+    if (address == MAP_FAILED) {
+        return false;
+    }
+
+    mapping = static_cast<const unsigned char*>(address);
+    length  = st.st_size;
+    mapped  = true;
+    return true;
+#else
+    std::ifstream file(path, std::ios::binary | std::ios::ate);
+    if (!file) {
+        return false;
+    }
+
+    length             = file.tellg();
+    unsigned char* buf = new unsigned char[length];
+    file.seekg(0);
+    file.read(reinterpret_cast<char*>(buf), length);
+
+    mapping = buf;
+    mapped  = false;
+    return true;
+#endif
+}
+
+void MappedFile::close() {
+    if (mapping == nullptr) {
+        return;
+    }
+
+#if defined(HAS_MMAP)
+    if (mapped) {
+        munmap(const_cast<unsigned char*>(mapping), length);
+    }
+#else
+    delete[] mapping;
+#endif
+
+    mapping = nullptr;
+    length  = 0;
+    mapped  = false;
+}
+
+void MappedFile::advise(std::size_t offset, std::size_t size, Advice advice) const {
+#if defined(HAS_MMAP)
+    if (!mapped || offset >= length) {
+        return;
+    }
+
+    // madvise wants a page aligned start
+    const std::size_t page  = static_cast<std::size_t>(sysconf(_SC_PAGESIZE));
+    const std::size_t start = offset / page * page;
+    const std::size_t end   = std::min(length, offset + size);
+
+    int flag = MADV_NORMAL;
+    switch (advice) {
+        case Advice::Normal:
+            flag = MADV_NORMAL;
+            break;
+        case Advice::Sequential:
+            flag = MADV_SEQUENTIAL;
+            break;
+        case Advice::Random:
+            flag = MADV_RANDOM;
+            break;
+        case Advice::WillNeed:
+            flag = MADV_WILLNEED;
+            break;
+    }
+
+    madvise(const_cast<unsigned char*>(mapping) + start, end - start, flag);
+#else
+    (void) offset;
+    (void) size;
+    (void) advice;
+#endif
+}
@@ -0,0 +1,45 @@
+#pragma once
+
+#include <cstddef>
+#include <string>
+
+// Read only memory mapping of a whole file. Falls back to reading the file
+// into memory on platforms without mmap.
+class MappedFile {
+private:
+    const unsigned char* mapping = nullptr;
+    std::size_t          length  = 0;
+    bool                 mapped  = false;
+
+public:
+    enum class Advice {
+        Normal,
+        Sequential,
+        Random,
+        WillNeed,
+    };
+
+    MappedFile() = default;
+    ~MappedFile();
+
+    MappedFile(const MappedFile&)            = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+
+    bool open(const std::string& path);
+    void close();
+
+    // Hint the kernel about the access pattern of [offset, offset + size)
+    void advise(std::size_t offset, std::size_t size, Advice advice) const;
+
+    bool isOpen() const {
+        return mapping != nullptr;
+    }
+
+    const unsigned char* data() const {
+        return mapping;
+    }
+
+    std::size_t size() const {
+        return length;
+    }
+};
@@ -1,64 +1,131 @@
 #include "nn.h"
+#include "checkpointwriter.h"
+#include "quantize.h"
+#include "simd.h"
 #include "types.h"
 #include <fstream>
 #include <iostream>
-#include <omp.h>
 
 // The forward pass of the network
-const float NN::forward(Accumulator& accumulator, Features& features, Color stm) const {
-    float output = hiddenBias[0]; // Initialize with the bias
+const float NN::forward(Accumulator& accumulator, const int16_t* stmFeatures, const int16_t* nstmFeatures, int count) const {
+    const Simd::Kernels& simd = Simd::kernels();
 
-    float* stmAccumulator = accumulator.data();
+    float* stmAccumulator  = accumulator.data();
     float* nstmAccumulator = accumulator.data() + HIDDEN_SIZE;
 
-    std::memcpy(stmAccumulator, inputBias.data(), sizeof(float) * HIDDEN_SIZE);
-    std::memcpy(nstmAccumulator, inputBias.data(), sizeof(float) * HIDDEN_SIZE);
+    if (quantized()) {
+        simd.accumulateInt16(stmAccumulator, inputBiasQuantized.data(), inputQuantized.data(), HIDDEN_SIZE, stmFeatures, 1, count, HIDDEN_SIZE);
+        simd.accumulateInt16(nstmAccumulator, inputBiasQuantized.data(), inputQuantized.data(), HIDDEN_SIZE, nstmFeatures, 1, count, HIDDEN_SIZE);
 
-    for (int i = 0; i < features.n; i++) {
-        for (int j = 0; j < HIDDEN_SIZE; j++) {
-            stmAccumulator[j] += inputFeatures[features.features[i][stm] * HIDDEN_SIZE + j];
-            nstmAccumulator[j] += inputFeatures[features.features[i][!stm] * HIDDEN_SIZE + j];
-        }
+        // ReLU and int16 saturation, back to the float scale
+        simd.clampScale(accumulator.data(), 0.0f, ACCUMULATOR_MAX, 1.0f / quant.qa, HIDDEN_SIZE * 2);
+
+        return truncateEval(hiddenBiasQuantized + simd.dot(hiddenQuantized.data(), accumulator.data(), HIDDEN_SIZE * 2));
     }
-    
-    for (int i = 0; i < HIDDEN_SIZE * 2; ++i){
-        accumulator[i] = ReLU(accumulator[i]);
+
+    if (mixedPrecision()) {
+        simd.accumulateBf16(stmAccumulator, inputBias.data(), inputShadow.data(), HIDDEN_SIZE, stmFeatures, 1, count, HIDDEN_SIZE);
+        simd.accumulateBf16(nstmAccumulator, inputBias.data(), inputShadow.data(), HIDDEN_SIZE, nstmFeatures, 1, count, HIDDEN_SIZE);
+    } else {
+        simd.accumulate(stmAccumulator, inputBias.data(), inputFeatures.data(), HIDDEN_SIZE, stmFeatures, 1, count, HIDDEN_SIZE);
+        simd.accumulate(nstmAccumulator, inputBias.data(), inputFeatures.data(), HIDDEN_SIZE, nstmFeatures, 1, count, HIDDEN_SIZE);
     }
 
-    #pragma omp simd reduction(+:output)
-    for (int i = 0; i < HIDDEN_SIZE; ++i){
-        output += hiddenFeatures[i] * stmAccumulator[i];
+    simd.relu(accumulator.data(), HIDDEN_SIZE * 2);
+
+    return hiddenBias[0] + simd.dot(hiddenFeatures.data(), accumulator.data(), HIDDEN_SIZE * 2);
+}
+
+void NN::setMixedPrecision(bool enabled) {
+    inputShadow.resize(enabled ? INPUT_SIZE * HIDDEN_SIZE : 0);
+    refreshShadow(0, INPUT_SIZE * HIDDEN_SIZE);
+}
+
+void NN::setQuantization(bool enabled, const QuantScheme& scheme) {
+    quant = scheme;
+    inputQuantized.resize(enabled ? INPUT_SIZE * HIDDEN_SIZE : 0);
+    refreshShadow(0, INPUT_SIZE * HIDDEN_SIZE);
+    refreshQuantizedDense();
+}
+
+void NN::refreshShadow(std::size_t offset, int n) {
+    if (quantized()) {
+        Simd::kernels().quantize(inputQuantized.data() + offset, inputFeatures.data() + offset, quant.qa, quant.inputLimit(), n);
     }
 
-    #pragma omp simd reduction(+:output)
-    for (int i = 0; i < HIDDEN_SIZE; ++i){
-        output += hiddenFeatures[HIDDEN_SIZE + i] * nstmAccumulator[i];
+    if (mixedPrecision()) {
+        Simd::kernels().toBf16(inputShadow.data() + offset, inputFeatures.data() + offset, n);
     }
-    
-    return output;
+}
+
+void NN::refreshShadows() {
+    refreshShadow(0, INPUT_SIZE * HIDDEN_SIZE);
+    refreshQuantizedDense();
+}
+
+void NN::refreshQuantizedDense() {
+    if (!quantized()) {
+        return;
+    }
+
+    for (int i = 0; i < HIDDEN_SIZE; ++i) {
+        inputBiasQuantized[i] = quantizeWeight(inputBias[i], quant.qa, INT16_LIMIT);
+    }
+
+    for (int i = 0; i < HIDDEN_SIZE * 2; ++i) {
+        hiddenQuantized[i] = quantizeWeight(hiddenFeatures[i], quant.qb, quant.outputLimit()) / static_cast<float>(quant.qb);
+    }
+
+    // The engine keeps the output bias in 32 bits
+    const float outputScale = static_cast<float>(quant.qa) * quant.qb;
+    hiddenBiasQuantized     = std::nearbyint(hiddenBias[0] * outputScale) / outputScale;
 }
 
 void NN::load(const std::string& path) {
     std::ifstream file(path, std::ios::binary);
 
     if (file) {
+        file.seekg(0, std::ios::end);
+        const std::size_t size = file.tellg();
+        file.seekg(0);
+
+        // Older checkpoints stored inputFeatures a second time in place of hiddenFeatures
+        const bool legacy = size == 2 * sizeof(inputFeatures) + sizeof(inputBias) + sizeof(hiddenBias);
+
         file.read(reinterpret_cast<char*>(inputFeatures.data()), sizeof(inputFeatures));
         file.read(reinterpret_cast<char*>(inputBias.data()), sizeof(inputBias));
-        file.read(reinterpret_cast<char*>(inputFeatures.data()), sizeof(inputFeatures));
+
+        if (legacy) {
+            std::cout << "Checkpoint " << path << " has no hidden layer, keeping the initial one" << std::endl;
+            file.seekg(sizeof(inputFeatures), std::ios::cur);
+        } else {
+            file.read(reinterpret_cast<char*>(hiddenFeatures.data()), sizeof(hiddenFeatures));
+        }
+
         file.read(reinterpret_cast<char*>(hiddenBias.data()), sizeof(hiddenBias));
+
+        refreshShadows();
     } else {
         std::cout << "Couldn't read checkpoint file " << path << std::endl;
     }
 }
 
+std::vector<FileSection> NN::sections() const {
+    return {
+        {inputFeatures.data(), sizeof(inputFeatures)},
+        {inputBias.data(), sizeof(inputBias)},
+        {hiddenFeatures.data(), sizeof(hiddenFeatures)},
+        {hiddenBias.data(), sizeof(hiddenBias)},
+    };
+}
+
 void NN::save(const std::string& path) {
     std::ofstream file(path, std::ios::binary);
 
     if (file) {
-        file.write(reinterpret_cast<char*>(inputFeatures.data()), sizeof(inputFeatures));
-        file.write(reinterpret_cast<char*>(inputBias.data()), sizeof(inputBias));
-        file.write(reinterpret_cast<char*>(inputFeatures.data()), sizeof(inputFeatures));
-        file.write(reinterpret_cast<char*>(hiddenBias.data()), sizeof(hiddenBias));
+        for (const FileSection& section : sections()) {
+            file.write(static_cast<const char*>(section.data), section.size);
+        }
     } else {
         std::cout << "Couldn't write checkpoint file " << path << std::endl;
     }
@@ -1,17 +1,117 @@
 #include "optimizer.h"
-#include "types.h"
-#include <algorithm>
+#include <cmath>
+#include <cstring>
 
-void adamUpdate(float& v, Gradient& grad, const float gsum, const float lr) {
-    grad.M = BETA1 * grad.M + (1 - BETA1) * gsum;
-    grad.V = BETA2 * grad.V + (1 - BETA2) * gsum * gsum;
+namespace {
+    constexpr const char* NAMES[OPTIMIZER_COUNT]              = {"sgd", "momentum", "adam", "adamw", "adamax"};
+    constexpr const char* STORAGE_NAMES[MOMENT_STORAGE_COUNT] = {"fp32", "bf16", "fp16"};
 
-    v -= lr * grad.M / (sqrt(grad.V) + EPSILON);
+    // ratio * (1 - ratio^k) / (1 - ratio), the sum of ratio^i for i in [1, k]
+    double geometricSeries(const double ratio, const double k) {
+        return ratio == 1.0 ? k : ratio * (1.0 - std::pow(ratio, k)) / (1.0 - ratio);
+    }
+} // namespace
+
+bool parseOptimizer(const char* name, Optimizer& optimizer) {
+    for (int i = 0; i < OPTIMIZER_COUNT; ++i) {
+        if (std::strcmp(name, NAMES[i]) == 0) {
+            optimizer = static_cast<Optimizer>(i);
+            return true;
+        }
+    }
+    return false;
+}
+
+const char* optimizerName(const Optimizer optimizer) {
+    return NAMES[static_cast<int>(optimizer)];
+}
+
+bool parseMomentStorage(const char* name, MomentStorage& storage) {
+    for (int i = 0; i < MOMENT_STORAGE_COUNT; ++i) {
+        if (std::strcmp(name, STORAGE_NAMES[i]) == 0) {
+            storage = static_cast<MomentStorage>(i);
+            return true;
+        }
+    }
+    return false;
+}
+
+const char* momentStorageName(const MomentStorage storage) {
+    return STORAGE_NAMES[static_cast<int>(storage)];
+}
+
+bool usesFirstMoment(const Optimizer optimizer) {
+    return optimizer != Optimizer::SGD;
 }
 
-void adamaxUpdate(float& v, Gradient& grad, const float gsum, const float lr) {
-    grad.M = BETA1 * grad.M + (1 - BETA1) * gsum;
-    grad.V = std::max(BETA2 * grad.V, std::abs(gsum));
+bool usesSecondMoment(const Optimizer optimizer) {
+    return optimizer != Optimizer::SGD && optimizer != Optimizer::Momentum;
+}
+
+// With a zero gradient M decays by beta1 every step, V by beta2 (Adamax
+// takes max(beta2 * V, 0) which is the same), and Momentum moves the weight
+// by a geometric series of M. With epsilon in the denominator the Adam
+// updates are no geometric series, so their steps are replayed one by one.
+// An update shrinks by at least beta1 / sqrt(beta2), or beta1 / beta2 for
+// Adamax, each step, so the replay stops once the updates left can't move
+// the weight by half a float ulp. The rest of the steps only decay the
+// moments, and for AdamW shrink the weight by (1 - lr * decay) each.
+void catchUp(const Optimizer optimizer, const OptimizerParams& params, float* weights, float* m, float* v, const int n, const std::uint64_t skipped) {
+    if (skipped == 0 || optimizer == Optimizer::SGD) {
+        return;
+    }
+
+    const double k     = static_cast<double>(skipped);
+    const double beta1 = params.beta1;
+    const double beta2 = params.beta2;
 
-    v -= lr * grad.M / (grad.V + EPSILON);
-}
\ No newline at end of file
+    if (optimizer == Optimizer::Momentum) {
+        const float series = static_cast<float>(geometricSeries(beta1, k));
+        const float beta1k = static_cast<float>(std::pow(beta1, k));
+
+        for (int i = 0; i < n; ++i) {
+            weights[i] -= params.lr * series * m[i];
+            m[i] *= beta1k;
+        }
+        return;
+    }
+
+    const bool   adamax = optimizer == Optimizer::Adamax;
+    const double ratio  = adamax ? beta1 / beta2 : beta1 / std::sqrt(beta2);
+    const double shrink = optimizer == Optimizer::AdamW ? 1.0 - static_cast<double>(params.lr) * params.decay : 1.0;
+
+    // Bound on the sum of all later updates relative to the last one
+    const float tail = ratio < 1.0 ? static_cast<float>(ratio / (1.0 - ratio)) : 0.0f;
+
+    for (int i = 0; i < n; ++i) {
+        // Never had a gradient, so m is zero too and only the decay applies
+        if (v[i] <= 0) {
+            weights[i] *= static_cast<float>(std::pow(shrink, k));
+            continue;
+        }
+
+        float         weight = weights[i];
+        float         first  = m[i];
+        float         second = v[i];
+        std::uint64_t step   = 0;
+
+        while (step < skipped) {
+            first *= params.beta1;
+            second *= params.beta2;
+            step++;
+
+            const float update = params.lr * first / ((adamax ? second : std::sqrt(second)) + params.epsilon);
+            weight             = static_cast<float>(shrink) * weight - update;
+
+            if (tail > 0.0f && std::abs(update) * tail <= std::abs(weight) * 0x1p-25f) {
+                break;
+            }
+        }
+
+        const double left = static_cast<double>(skipped - step);
+
+        weights[i] = weight * static_cast<float>(std::pow(shrink, left));
+        m[i]       = first * static_cast<float>(std::pow(beta1, left));
+        v[i]       = second * static_cast<float>(std::pow(beta2, left));
+    }
+}
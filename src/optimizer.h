@@ -1,6 +1,51 @@
 #pragma once
 
-#include "gradient.h"
+#include <cstdint>
 
-void adamUpdate(float& v, Gradient& grad, const float gsum, const float lr);
-void adamaxUpdate(float& v, Gradient& grad, const float gsum, const float lr);
\ No newline at end of file
+enum class Optimizer {
+    SGD,
+    Momentum,
+    Adam,
+    AdamW,
+    Adamax,
+};
+
+constexpr int OPTIMIZER_COUNT = 5;
+
+// Precision the optimizer moments are kept in. The 16 bit formats are
+// widened to fp32 in registers and written back with stochastic rounding.
+enum class MomentStorage {
+    FP32,
+    BF16,
+    FP16,
+};
+
+constexpr int MOMENT_STORAGE_COUNT = 3;
+
+// Hyperparameters of one optimizer step. Momentum uses beta1 as its
+// momentum, only AdamW uses the weight decay.
+struct OptimizerParams {
+    float lr;
+    float beta1;
+    float beta2;
+    float epsilon;
+    float decay;
+};
+
+// Returns false if the name is unknown
+bool parseOptimizer(const char* name, Optimizer& optimizer);
+
+const char* optimizerName(const Optimizer optimizer);
+
+bool        parseMomentStorage(const char* name, MomentStorage& storage);
+const char* momentStorageName(const MomentStorage storage);
+
+// Whether the optimizer keeps a first / second moment per weight
+bool usesFirstMoment(const Optimizer optimizer);
+bool usesSecondMoment(const Optimizer optimizer);
+
+// Applies `skipped` steps with a zero gradient, so rows that were left out
+// of some steps can catch up when they're next touched. Momentum is caught
+// up in closed form, the Adam variants replay the steps until their
+// updates drop below float precision.
+void catchUp(const Optimizer optimizer, const OptimizerParams& params, float* weights, float* m, float* v, const int n, const std::uint64_t skipped);
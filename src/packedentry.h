@@ -0,0 +1,80 @@
+#pragma once
+
+#include "binpackreader.h"
+
+#include <bit>
+#include <cstdint>
+
+namespace DataLoader {
+
+    // Fixed size 32 byte training record. The board is stored the way
+    // chess::CompressedPosition stores it, the occupancy bitboard plus one
+    // nibble per occupied square in bitboard order, except that the special
+    // nibbles (en passant pawn, castling rook, black king to move) are
+    // resolved to plain chess::Piece ids so features can be read directly.
+    struct PackedEntry {
+        std::uint64_t occupancy;
+        std::uint8_t  pieces[16];
+        std::int16_t  score;
+        std::uint16_t ply;
+        std::int8_t   result;
+        std::uint8_t  stm;
+        std::uint8_t  kingSquares[2];
+
+        static PackedEntry fromEntry(const binpack::TrainingDataEntry& entry) {
+            PackedEntry packed;
+
+            chess::CompressedPosition compressed = entry.pos.compress();
+            unsigned char             bytes[24];
+            compressed.writeToBigEndian(bytes);
+
+            packed.occupancy = 0;
+            for (int i = 0; i < 8; ++i) {
+                packed.occupancy = (packed.occupancy << 8) | bytes[i];
+            }
+            std::memcpy(packed.pieces, bytes + 8, 16);
+
+            int i = 0;
+            for (std::uint64_t bb = packed.occupancy; bb; bb &= bb - 1, ++i) {
+                const int sq = std::countr_zero(bb);
+
+                switch (packed.pieceAt(i)) {
+                    case 12:
+                        // Pawn that just made a double push, rank 4 is white
+                        packed.setPieceAt(i, sq < 32 ? 0 : 1);
+                        break;
+                    case 13:
+                        packed.setPieceAt(i, 6);
+                        break;
+                    case 14:
+                        packed.setPieceAt(i, 7);
+                        break;
+                    case 15:
+                        packed.setPieceAt(i, 11);
+                        break;
+                }
+            }
+
+            packed.score          = entry.score;
+            packed.ply            = entry.ply;
+            packed.result         = static_cast<std::int8_t>(entry.result);
+            packed.stm            = static_cast<std::uint8_t>(entry.pos.sideToMove());
+            packed.kingSquares[0] = static_cast<int>(entry.pos.kingSquare(chess::Color::White));
+            packed.kingSquares[1] = static_cast<int>(entry.pos.kingSquare(chess::Color::Black));
+
+            return packed;
+        }
+
+        std::uint8_t pieceAt(const int i) const {
+            return (pieces[i / 2] >> (4 * (i & 1))) & 0xF;
+        }
+
+        void setPieceAt(const int i, const std::uint8_t piece) {
+            const int shift = 4 * (i & 1);
+            pieces[i / 2]   = (pieces[i / 2] & ~(0xF << shift)) | (piece << shift);
+        }
+    };
+
+    static_assert(sizeof(PackedEntry) == 32);
+
+} // namespace DataLoader
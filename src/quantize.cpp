@@ -0,0 +1,139 @@
+#include "quantize.h"
+#include "checkpointwriter.h"
+#include "dataloader.h"
+#include "types.h"
+
+#include <algorithm>
+#include <cmath>
+#include <fstream>
+#include <iostream>
+
+// Columns one pair of AVX2 accumulator registers covers
+constexpr int INTERLEAVE_BLOCK = 32;
+
+static int quantLimit(const float clip, const int scale, const int typeLimit) {
+    if (clip <= 0) {
+        return typeLimit;
+    }
+
+    return std::min(typeLimit, static_cast<int>(clip * scale));
+}
+
+int QuantScheme::inputLimit() const {
+    return quantLimit(inputClip, qa, INT16_LIMIT);
+}
+
+int QuantScheme::outputLimit() const {
+    return quantLimit(outputClip, qb, outputInt8 ? INT8_LIMIT : INT16_LIMIT);
+}
+
+QuantizedNN::QuantizedNN(const NN& nn, const QuantScheme& _scheme) : scheme(_scheme) {
+    inputFeatures.resize(INPUT_SIZE * HIDDEN_SIZE);
+    inputBias.resize(HIDDEN_SIZE);
+    hiddenFeatures.resize(HIDDEN_SIZE * 2);
+
+    for (int i = 0; i < INPUT_SIZE * HIDDEN_SIZE; ++i) {
+        inputFeatures[i] = quantizeWeight(nn.inputFeatures[i], scheme.qa, scheme.inputLimit());
+    }
+
+    for (int i = 0; i < HIDDEN_SIZE; ++i) {
+        inputBias[i] = quantizeWeight(nn.inputBias[i], scheme.qa, INT16_LIMIT);
+    }
+
+    for (int i = 0; i < HIDDEN_SIZE * 2; ++i) {
+        hiddenFeatures[i] = quantizeWeight(nn.hiddenFeatures[i], scheme.qb, scheme.outputLimit());
+    }
+
+    hiddenBias = static_cast<std::int32_t>(std::nearbyint(static_cast<double>(nn.hiddenBias[0]) * scheme.qa * scheme.qb));
+}
+
+int QuantizedNN::evaluate(const std::int16_t* stmFeatures, const std::int16_t* nstmFeatures, int count) const {
+    std::int64_t sum = hiddenBias;
+
+    const std::int16_t* perspectives[2] = {stmFeatures, nstmFeatures};
+
+    for (int side = 0; side < 2; ++side) {
+        for (int i = 0; i < HIDDEN_SIZE; ++i) {
+            int accumulator = inputBias[i];
+            for (int f = 0; f < count; ++f) {
+                accumulator += inputFeatures[perspectives[side][f] * HIDDEN_SIZE + i];
+            }
+
+            accumulator = std::clamp(accumulator, static_cast<int>(ACCUMULATOR_MIN), static_cast<int>(ACCUMULATOR_MAX));
+            sum += static_cast<std::int64_t>(std::max(accumulator, 0)) * hiddenFeatures[side * HIDDEN_SIZE + i];
+        }
+    }
+
+    return static_cast<int>(sum * static_cast<std::int64_t>(EVAL_SCALE) / (static_cast<std::int64_t>(scheme.qa) * scheme.qb));
+}
+
+bool QuantizedNN::save(const std::string& path, bool interleave) const {
+    std::vector<char> bytes;
+
+    const auto append = [&bytes](const void* data, const std::size_t size) {
+        const char* begin = static_cast<const char*>(data);
+        bytes.insert(bytes.end(), begin, begin + size);
+    };
+
+    // Swaps the middle two 8 column blocks of every 32 columns
+    const auto writeRow = [&](const std::int16_t* row) {
+        if (!interleave) {
+            append(row, sizeof(std::int16_t) * HIDDEN_SIZE);
+            return;
+        }
+
+        std::int16_t permuted[HIDDEN_SIZE];
+        for (int block = 0; block < HIDDEN_SIZE; block += INTERLEAVE_BLOCK) {
+            for (int k = 0; k < 8; ++k) {
+                permuted[block + k]      = row[block + k];
+                permuted[block + 8 + k]  = row[block + 16 + k];
+                permuted[block + 16 + k] = row[block + 8 + k];
+                permuted[block + 24 + k] = row[block + 24 + k];
+            }
+        }
+        append(permuted, sizeof(permuted));
+    };
+
+    static_assert(HIDDEN_SIZE % INTERLEAVE_BLOCK == 0);
+
+    for (int feature = 0; feature < INPUT_SIZE; ++feature) {
+        writeRow(inputFeatures.data() + feature * HIDDEN_SIZE);
+    }
+    writeRow(inputBias.data());
+
+    if (scheme.outputInt8) {
+        std::vector<std::int8_t> narrow(hiddenFeatures.begin(), hiddenFeatures.end());
+        append(narrow.data(), narrow.size());
+    } else {
+        append(hiddenFeatures.data(), sizeof(std::int16_t) * hiddenFeatures.size());
+    }
+
+    append(&hiddenBias, sizeof(hiddenBias));
+
+    return CheckpointWriter::writeFile(path, bytes.data(), bytes.size());
+}
+
+QuantError verifyQuantized(const NN& nn, const QuantizedNN& quantized, const DataLoader::Batch& batch, int positions) {
+    positions = std::min<int>(positions, static_cast<int>(batch.size));
+
+    QuantError     result{positions, 0.0, 0.0};
+    NN::Accumulator accumulator;
+
+    for (int sample = 0; sample < positions; ++sample) {
+        const std::int16_t* stmFeatures  = batch.stmFeatures.data() + batch.offsets[sample];
+        const std::int16_t* nstmFeatures = batch.nstmFeatures.data() + batch.offsets[sample];
+        const int           count        = batch.featureCount(sample);
+
+        const double expected = nn.forward(accumulator, stmFeatures, nstmFeatures, count) * EVAL_SCALE;
+        const double error    = std::abs(expected - quantized.evaluate(stmFeatures, nstmFeatures, count));
+
+        result.maxError = std::max(result.maxError, error);
+        result.meanError += error;
+    }
+
+    if (positions > 0) {
+        result.meanError /= positions;
+    }
+
+    return result;
+}
@@ -0,0 +1,59 @@
+#pragma once
+
+#include "quantscheme.h"
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+struct NN;
+
+namespace DataLoader {
+    struct Batch;
+}
+
+constexpr int INT16_LIMIT = 32767;
+constexpr int INT8_LIMIT  = 127;
+
+constexpr float ACCUMULATOR_MIN = -32768.0f;
+constexpr float ACCUMULATOR_MAX = 32767.0f;
+
+// Rounds to nearest and saturates to [-limit, limit]. Plain builtins so the
+// SIMD kernels can use it too (see simd_kernels.h).
+static inline std::int16_t quantizeWeight(const float weight, const float scale, const int limit) {
+    const float x   = __builtin_nearbyintf(weight * scale);
+    const float max = static_cast<float>(limit);
+    return static_cast<std::int16_t>(x < -max ? -max : x > max ? max : x);
+}
+
+// Integer network as the engine stores it, in the trainer's layout
+struct QuantizedNN {
+    QuantScheme               scheme;
+    std::vector<std::int16_t> inputFeatures;
+    std::vector<std::int16_t> inputBias;
+    std::vector<std::int16_t> hiddenFeatures;
+    std::int32_t              hiddenBias = 0;
+
+    QuantizedNN(const NN& nn, const QuantScheme& _scheme);
+
+    // Eval in centipawns, computed the way the engine does it: int16
+    // accumulators (saturated), ReLU, int32 output sum
+    int evaluate(const std::int16_t* stmFeatures, const std::int16_t* nstmFeatures, int count) const;
+
+    // Writes inputFeatures, inputBias, hiddenFeatures (int16 or int8) and the
+    // int32 hiddenBias through a synced temporary file, like the checkpoints.
+    // With `interleave` every 32 columns of the input layer are stored in the
+    // order _mm256_packs_epi16 leaves them in, so an AVX2 engine can pack its
+    // accumulators without permuting them back.
+    bool save(const std::string& path, bool interleave) const;
+};
+
+struct QuantError {
+    int    positions;
+    double maxError;
+    double meanError;
+};
+
+// Compares nn.forward with the integer network over the first `positions`
+// samples of a batch, errors are in centipawns
+QuantError verifyQuantized(const NN& nn, const QuantizedNN& quantized, const DataLoader::Batch& batch, int positions);
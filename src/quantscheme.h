@@ -0,0 +1,18 @@
+#pragma once
+
+// Fixed point format of the engine's network. Input weights and biases are
+// int16 scaled by qa and summed into int16 accumulators, output weights are
+// int16 (or int8) scaled by qb and the output bias is int32 scaled by qa * qb.
+struct QuantScheme {
+    int qa = 255;
+    int qb = 64;
+
+    // Largest weight magnitude before scaling, 0 only clips at the integer range
+    float inputClip  = 0;
+    float outputClip = 0;
+
+    bool outputInt8 = false;
+
+    int inputLimit() const;
+    int outputLimit() const;
+};
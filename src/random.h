@@ -0,0 +1,61 @@
+#pragma once
+
+#include <cstdint>
+
+namespace DataLoader {
+
+    inline std::uint64_t splitmix64(std::uint64_t x) {
+        x += 0x9E3779B97F4A7C15ull;
+        x = (x ^ (x >> 30)) * 0xBF58476D1CE4E5B9ull;
+        x = (x ^ (x >> 27)) * 0x94D049BB133111EBull;
+        return x ^ (x >> 31);
+    }
+
+    // xoshiro256**, a few cycles per number, seeded through splitmix64 so
+    // nearby seeds give unrelated streams
+    class Random {
+    private:
+        std::uint64_t state[4];
+
+        static std::uint64_t rotl(const std::uint64_t x, const int k) {
+            return (x << k) | (x >> (64 - k));
+        }
+
+    public:
+        explicit Random(const std::uint64_t seed = 0) {
+            reseed(seed);
+        }
+
+        void reseed(std::uint64_t seed) {
+            for (std::uint64_t& s : state) {
+                seed += 0x9E3779B97F4A7C15ull;
+                s = splitmix64(seed);
+            }
+        }
+
+        std::uint64_t next() {
+            const std::uint64_t result = rotl(state[1] * 5, 7) * 9;
+            const std::uint64_t t      = state[1] << 17;
+
+            state[2] ^= state[0];
+            state[3] ^= state[1];
+            state[1] ^= state[2];
+            state[0] ^= state[3];
+            state[2] ^= t;
+            state[3] = rotl(state[3], 45);
+
+            return result;
+        }
+
+        // Uniform in [0, 1)
+        double uniform() {
+            return (next() >> 11) * 0x1.0p-53;
+        }
+
+        // Uniform in [0, n) by multiply and shift, the bias is negligible for n < 2^32
+        std::uint64_t below(const std::uint64_t n) {
+            return static_cast<std::uint64_t>((static_cast<unsigned __int128>(next()) * n) >> 64);
+        }
+    };
+
+} // namespace DataLoader
@@ -0,0 +1,59 @@
+#include "simd.h"
+
+#include <cstring>
+#include <iostream>
+
+namespace Simd {
+
+    namespace {
+        const Kernels* active = nullptr;
+
+        bool supported(const char* name) {
+#if defined(__x86_64__) || defined(__i386__)
+            __builtin_cpu_init();
+            if (std::strcmp(name, "avx512") == 0) {
+                return avx512Kernels() != nullptr && __builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512bw") && __builtin_cpu_supports("avx512vl");
+            }
+            if (std::strcmp(name, "avx2") == 0) {
+                return avx2Kernels() != nullptr && __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma") && __builtin_cpu_supports("f16c");
+            }
+#endif
+            return std::strcmp(name, "sse2") == 0 || std::strcmp(name, "scalar") == 0;
+        }
+
+        const Kernels* byName(const char* name) {
+            if (std::strcmp(name, "avx512") == 0) {
+                return avx512Kernels();
+            }
+            if (std::strcmp(name, "avx2") == 0) {
+                return avx2Kernels();
+            }
+            return sse2Kernels();
+        }
+    } // namespace
+
+    void init(const char* preferred) {
+        if (preferred != nullptr && preferred[0] != '\0') {
+            if (supported(preferred)) {
+                active = byName(preferred);
+                return;
+            }
+            std::cout << "SIMD kernels " << preferred << " are not supported on this CPU, picking the best available" << std::endl;
+        }
+
+        for (const char* name : {"avx512", "avx2", "sse2"}) {
+            if (supported(name)) {
+                active = byName(name);
+                return;
+            }
+        }
+    }
+
+    const Kernels& kernels() {
+        if (active == nullptr) {
+            init();
+        }
+        return *active;
+    }
+
+} // namespace Simd
@@ -0,0 +1,73 @@
+#pragma once
+
+#include "optimizer.h"
+
+#include <cstdint>
+
+// Hand written kernels for the hot loops of the trainer. Every instruction
+// set gets its own translation unit (simd_avx512.cpp, simd_avx2.cpp,
+// simd_sse2.cpp) built with matching compiler flags, and the best table
+// the running CPU supports is picked once at startup.
+namespace Simd {
+
+    struct Kernels {
+        const char* name;
+
+        // out[0..n) = bias[0..n) + sum of weights[rows[i * rowStride] * weightStride + 0..n)
+        void (*accumulate)(float* out, const float* bias, const float* weights, int weightStride, const std::int16_t* rows, int rowStride, int count, int n);
+
+        // accumulate with bf16 weights
+        void (*accumulateBf16)(float* out, const float* bias, const std::uint16_t* weights, int weightStride, const std::int16_t* rows, int rowStride, int count, int n);
+
+        // dst[0..n) = src[0..n) rounded to bf16
+        void (*toBf16)(std::uint16_t* dst, const float* src, int n);
+
+        // accumulate with int16 weights and a bias holding whole numbers,
+        // the sums are exact
+        void (*accumulateInt16)(float* out, const float* bias, const std::int16_t* weights, int weightStride, const std::int16_t* rows, int rowStride, int count, int n);
+
+        // dst[0..n) = src[0..n) * scale rounded to nearest and saturated to [-limit, limit]
+        void (*quantize)(std::int16_t* dst, const float* src, float scale, int limit, int n);
+
+        // x = min(max(x, lo), hi) * scale
+        void (*clampScale)(float* x, float lo, float hi, float scale, int n);
+
+        // x = max(x, 0)
+        void (*relu)(float* x, int n);
+
+        // sum of a[i] * b[i]
+        float (*dot)(const float* a, const float* b, int n);
+
+        // dst += src
+        void (*addRow)(float* dst, const float* src, int n);
+
+        // grads[rows[i * rowStride] * gradStride + 0..n) += src[0..n)
+        void (*scatter)(float* grads, int gradStride, const std::int16_t* rows, int rowStride, int count, const float* src, int n);
+
+        // dst += a * x
+        void (*axpy)(float* dst, float a, const float* x, int n);
+
+        // out = a * w where acc > 0, otherwise 0
+        void (*reluBackward)(float* out, float a, const float* w, const float* acc, int n);
+
+        // One optimizer step on weights[0..n) with the gradient summed over
+        // grads[0..count)[0..n), which are cleared on the way. m and v are
+        // the moments in the given storage, `seed` drives the stochastic
+        // rounding of 16 bit moments. Indexed by MomentStorage, Optimizer.
+        void (*update[MOMENT_STORAGE_COUNT][OPTIMIZER_COUNT])(const OptimizerParams& params, float* weights, void* m, void* v, float* const* grads, int count, int n, std::uint32_t seed);
+    };
+
+    // Selects the kernel table. An empty or unknown name picks the best
+    // supported instruction set, otherwise the named set is used if the
+    // CPU supports it.
+    void init(const char* preferred = nullptr);
+
+    const Kernels& kernels();
+
+    // Defined by the per instruction set translation units. Only call them
+    // when the CPU supports the instruction set.
+    const Kernels* sse2Kernels();
+    const Kernels* avx2Kernels();
+    const Kernels* avx512Kernels();
+
+} // namespace Simd
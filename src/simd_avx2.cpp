@@ -0,0 +1,122 @@
+// Built with -mavx2 -mfma -mf16c, only called when the CPU supports it.
+#include "simd_kernels.h"
+
+#if defined(__AVX2__) && defined(__FMA__) && defined(__F16C__)
+    #include <immintrin.h>
+
+namespace {
+    struct Vec {
+        using type                 = __m256;
+        static constexpr int width = 8;
+
+        static constexpr bool bf16 = true;
+        static constexpr bool fp16 = true;
+
+        // One xorshift32 stream per lane
+        struct Random {
+            __m256i state;
+
+            explicit Random(std::uint32_t seed) {
+                alignas(32) std::uint32_t lanes[width];
+                for (int i = 0; i < width; ++i) {
+                    lanes[i] = (seed ^ (i + 1) * 0x9E3779B9u) | 1;
+                }
+                state = _mm256_load_si256(reinterpret_cast<const __m256i*>(lanes));
+            }
+
+            __m256i next() {
+                state = _mm256_xor_si256(state, _mm256_slli_epi32(state, 13));
+                state = _mm256_xor_si256(state, _mm256_srli_epi32(state, 17));
+                state = _mm256_xor_si256(state, _mm256_slli_epi32(state, 5));
+                return state;
+            }
+        };
+
+        static type load(const float* p) {
+            return _mm256_loadu_ps(p);
+        }
+        static void store(float* p, type v) {
+            _mm256_storeu_ps(p, v);
+        }
+        static type loadBf16(const std::uint16_t* p) {
+            return _mm256_castsi256_ps(_mm256_slli_epi32(_mm256_cvtepu16_epi32(_mm_loadu_si128(reinterpret_cast<const __m128i*>(p))), 16));
+        }
+        static void storeBf16(std::uint16_t* p, type v, __m256i random) {
+            const __m256i bits   = _mm256_srli_epi32(_mm256_add_epi32(_mm256_castps_si256(v), _mm256_and_si256(random, _mm256_set1_epi32(0xFFFF))), 16);
+            const __m256i packed = _mm256_permute4x64_epi64(_mm256_packus_epi32(bits, bits), 0x08);
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(p), _mm256_castsi256_si128(packed));
+        }
+        // Rounds to nearest even, the same as floatToBf16
+        static void storeBf16Nearest(std::uint16_t* p, type v) {
+            const __m256i odd = _mm256_and_si256(_mm256_srli_epi32(_mm256_castps_si256(v), 16), _mm256_set1_epi32(1));
+            storeBf16(p, v, _mm256_add_epi32(_mm256_set1_epi32(0x7FFF), odd));
+        }
+        static type loadInt16(const std::int16_t* p) {
+            return _mm256_cvtepi32_ps(_mm256_cvtepi16_epi32(_mm_loadu_si128(reinterpret_cast<const __m128i*>(p))));
+        }
+        // Rounds to nearest, v has to be in the int16 range
+        static void storeInt16(std::int16_t* p, type v) {
+            const __m256i x = _mm256_cvtps_epi32(v);
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(p), _mm_packs_epi32(_mm256_castsi256_si128(x), _mm256_extracti128_si256(x, 1)));
+        }
+        static type loadFp16(const std::uint16_t* p) {
+            return _mm256_cvtph_ps(_mm_loadu_si128(reinterpret_cast<const __m128i*>(p)));
+        }
+        // Noise below the fp16 mantissa, then truncate. Values in the fp16
+        // subnormal range are only truncated.
+        static void storeFp16(std::uint16_t* p, type v, __m256i random) {
+            const __m256i bits = _mm256_add_epi32(_mm256_castps_si256(v), _mm256_and_si256(random, _mm256_set1_epi32(0x1FFF)));
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(p), _mm256_cvtps_ph(_mm256_castsi256_ps(bits), _MM_FROUND_TO_ZERO | _MM_FROUND_NO_EXC));
+        }
+        static type zero() {
+            return _mm256_setzero_ps();
+        }
+        static type set1(float x) {
+            return _mm256_set1_ps(x);
+        }
+        static type add(type a, type b) {
+            return _mm256_add_ps(a, b);
+        }
+        static type mul(type a, type b) {
+            return _mm256_mul_ps(a, b);
+        }
+        static type div(type a, type b) {
+            return _mm256_div_ps(a, b);
+        }
+        static type max(type a, type b) {
+            return _mm256_max_ps(a, b);
+        }
+        static type min(type a, type b) {
+            return _mm256_min_ps(a, b);
+        }
+        static type fmadd(type a, type b, type c) {
+            return _mm256_fmadd_ps(a, b, c);
+        }
+        static type sqrt(type a) {
+            return _mm256_sqrt_ps(a);
+        }
+        static type abs(type a) {
+            return _mm256_andnot_ps(_mm256_set1_ps(-0.0f), a);
+        }
+        static type positiveOnly(type mask, type v) {
+            return _mm256_and_ps(_mm256_cmp_ps(mask, _mm256_setzero_ps(), _CMP_GT_OQ), v);
+        }
+        static float reduce(type v) {
+            const __m128 sum128 = _mm_add_ps(_mm256_castps256_ps128(v), _mm256_extractf128_ps(v, 1));
+            const __m128 sum64  = _mm_add_ps(sum128, _mm_movehl_ps(sum128, sum128));
+            const __m128 sum32  = _mm_add_ss(sum64, _mm_shuffle_ps(sum64, sum64, 0x55));
+            return _mm_cvtss_f32(sum32);
+        }
+    };
+
+    constexpr Simd::Kernels table = Simd::KernelSet<Vec>::table("avx2");
+} // namespace
+
+const Simd::Kernels* Simd::avx2Kernels() {
+    return &table;
+}
+#else
+const Simd::Kernels* Simd::avx2Kernels() {
+    return nullptr;
+}
+#endif
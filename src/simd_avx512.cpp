@@ -0,0 +1,117 @@
+// Built with -mavx512f -mavx512bw -mavx512vl -mfma, only called when the CPU supports it.
+#include "simd_kernels.h"
+
+#if defined(__AVX512F__)
+    #include <immintrin.h>
+
+namespace {
+    struct Vec {
+        using type                 = __m512;
+        static constexpr int width = 16;
+
+        static constexpr bool bf16 = true;
+        static constexpr bool fp16 = true;
+
+        // One xorshift32 stream per lane
+        struct Random {
+            __m512i state;
+
+            explicit Random(std::uint32_t seed) {
+                alignas(64) std::uint32_t lanes[width];
+                for (int i = 0; i < width; ++i) {
+                    lanes[i] = (seed ^ (i + 1) * 0x9E3779B9u) | 1;
+                }
+                state = _mm512_load_si512(lanes);
+            }
+
+            __m512i next() {
+                state = _mm512_xor_si512(state, _mm512_slli_epi32(state, 13));
+                state = _mm512_xor_si512(state, _mm512_srli_epi32(state, 17));
+                state = _mm512_xor_si512(state, _mm512_slli_epi32(state, 5));
+                return state;
+            }
+        };
+
+        static type load(const float* p) {
+            return _mm512_loadu_ps(p);
+        }
+        static void store(float* p, type v) {
+            _mm512_storeu_ps(p, v);
+        }
+        static type loadBf16(const std::uint16_t* p) {
+            return _mm512_castsi512_ps(_mm512_slli_epi32(_mm512_cvtepu16_epi32(_mm256_loadu_si256(reinterpret_cast<const __m256i*>(p))), 16));
+        }
+        static void storeBf16(std::uint16_t* p, type v, __m512i random) {
+            const __m512i bits = _mm512_add_epi32(_mm512_castps_si512(v), _mm512_and_si512(random, _mm512_set1_epi32(0xFFFF)));
+            _mm256_storeu_si256(reinterpret_cast<__m256i*>(p), _mm512_cvtepi32_epi16(_mm512_srli_epi32(bits, 16)));
+        }
+        // Rounds to nearest even, the same as floatToBf16
+        static void storeBf16Nearest(std::uint16_t* p, type v) {
+            const __m512i odd = _mm512_and_si512(_mm512_srli_epi32(_mm512_castps_si512(v), 16), _mm512_set1_epi32(1));
+            storeBf16(p, v, _mm512_add_epi32(_mm512_set1_epi32(0x7FFF), odd));
+        }
+        static type loadInt16(const std::int16_t* p) {
+            return _mm512_cvtepi32_ps(_mm512_cvtepi16_epi32(_mm256_loadu_si256(reinterpret_cast<const __m256i*>(p))));
+        }
+        // Rounds to nearest, v has to be in the int16 range
+        static void storeInt16(std::int16_t* p, type v) {
+            _mm256_storeu_si256(reinterpret_cast<__m256i*>(p), _mm512_cvtsepi32_epi16(_mm512_cvtps_epi32(v)));
+        }
+        static type loadFp16(const std::uint16_t* p) {
+            return _mm512_cvtph_ps(_mm256_loadu_si256(reinterpret_cast<const __m256i*>(p)));
+        }
+        // Noise below the fp16 mantissa, then truncate. Values in the fp16
+        // subnormal range are only truncated.
+        static void storeFp16(std::uint16_t* p, type v, __m512i random) {
+            const __m512i bits = _mm512_add_epi32(_mm512_castps_si512(v), _mm512_and_si512(random, _mm512_set1_epi32(0x1FFF)));
+            _mm256_storeu_si256(reinterpret_cast<__m256i*>(p), _mm512_cvtps_ph(_mm512_castsi512_ps(bits), _MM_FROUND_TO_ZERO | _MM_FROUND_NO_EXC));
+        }
+        static type zero() {
+            return _mm512_setzero_ps();
+        }
+        static type set1(float x) {
+            return _mm512_set1_ps(x);
+        }
+        static type add(type a, type b) {
+            return _mm512_add_ps(a, b);
+        }
+        static type mul(type a, type b) {
+            return _mm512_mul_ps(a, b);
+        }
+        static type div(type a, type b) {
+            return _mm512_div_ps(a, b);
+        }
+        static type max(type a, type b) {
+            return _mm512_max_ps(a, b);
+        }
+        static type min(type a, type b) {
+            return _mm512_min_ps(a, b);
+        }
+        static type fmadd(type a, type b, type c) {
+            return _mm512_fmadd_ps(a, b, c);
+        }
+        static type sqrt(type a) {
+            return _mm512_sqrt_ps(a);
+        }
+        static type abs(type a) {
+            return _mm512_abs_ps(a);
+        }
+        static type positiveOnly(type mask, type v) {
+            return _mm512_maskz_mov_ps(_mm512_cmp_ps_mask(mask, _mm512_setzero_ps(), _CMP_GT_OQ), v);
+        }
+        static float reduce(type v) {
+            return _mm512_reduce_add_ps(v);
+        }
+    };
+
+    constexpr Simd::Kernels table = Simd::KernelSet<Vec>::table("avx512");
+} // namespace
+
+const Simd::Kernels* Simd::avx512Kernels() {
+    return &table;
+}
+#else
+const Simd::Kernels* Simd::avx512Kernels() {
+    return nullptr;
+}
+#endif
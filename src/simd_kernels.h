@@ -0,0 +1,429 @@
+#pragma once
+
+#include "half.h"
+#include "quantize.h"
+#include "simd.h"
+
+// Kernel bodies shared by all instruction sets. Each simd_*.cpp defines a
+// `Vec` wrapper around its register type in an anonymous namespace and
+// instantiates KernelSet<Vec>, which gives every instantiation internal
+// linkage. Keep standard library calls out of here: inline functions
+// emitted from a wide instruction set TU could otherwise be picked by the
+// linker for the baseline code.
+namespace Simd {
+
+    template <typename Vec>
+    struct KernelSet {
+        using V = typename Vec::type;
+
+        static constexpr int W = Vec::width;
+
+        // Columns processed per pass so a tile of the accumulator stays in registers
+        static constexpr int TILE = W * 8;
+
+        static V loadWeights(const float* p) {
+            return Vec::load(p);
+        }
+        static V loadWeights(const std::uint16_t* p) {
+            return Vec::loadBf16(p);
+        }
+        static float weightAt(const float* p) {
+            return *p;
+        }
+        static float weightAt(const std::uint16_t* p) {
+            return bf16ToFloat(*p);
+        }
+        static V loadWeights(const std::int16_t* p) {
+            return Vec::loadInt16(p);
+        }
+        static float weightAt(const std::int16_t* p) {
+            return *p;
+        }
+
+        template <typename Weight>
+        static void accumulateRows(float* out, const float* bias, const Weight* weights, int weightStride, const std::int16_t* rows, int rowStride, int count, int n) {
+            int j = 0;
+
+            for (; j + TILE <= n; j += TILE) {
+                V acc[8];
+                for (int k = 0; k < 8; ++k) {
+                    acc[k] = Vec::load(bias + j + k * W);
+                }
+
+                for (int i = 0; i < count; ++i) {
+                    const Weight* row = weights + rows[i * rowStride] * weightStride + j;
+                    for (int k = 0; k < 8; ++k) {
+                        acc[k] = Vec::add(acc[k], loadWeights(row + k * W));
+                    }
+                }
+
+                for (int k = 0; k < 8; ++k) {
+                    Vec::store(out + j + k * W, acc[k]);
+                }
+            }
+
+            for (; j + W <= n; j += W) {
+                V acc = Vec::load(bias + j);
+                for (int i = 0; i < count; ++i) {
+                    acc = Vec::add(acc, loadWeights(weights + rows[i * rowStride] * weightStride + j));
+                }
+                Vec::store(out + j, acc);
+            }
+
+            for (; j < n; ++j) {
+                float acc = bias[j];
+                for (int i = 0; i < count; ++i) {
+                    acc += weightAt(weights + rows[i * rowStride] * weightStride + j);
+                }
+                out[j] = acc;
+            }
+        }
+
+        static void accumulate(float* out, const float* bias, const float* weights, int weightStride, const std::int16_t* rows, int rowStride, int count, int n) {
+            accumulateRows(out, bias, weights, weightStride, rows, rowStride, count, n);
+        }
+
+        static void accumulateBf16(float* out, const float* bias, const std::uint16_t* weights, int weightStride, const std::int16_t* rows, int rowStride, int count, int n) {
+            accumulateRows(out, bias, weights, weightStride, rows, rowStride, count, n);
+        }
+
+        static void accumulateInt16(float* out, const float* bias, const std::int16_t* weights, int weightStride, const std::int16_t* rows, int rowStride, int count, int n) {
+            accumulateRows(out, bias, weights, weightStride, rows, rowStride, count, n);
+        }
+
+        static void quantize(std::int16_t* dst, const float* src, float scale, int limit, int n) {
+            const V s  = Vec::set1(scale);
+            const V lo = Vec::set1(-static_cast<float>(limit));
+            const V hi = Vec::set1(static_cast<float>(limit));
+
+            int j = 0;
+            for (; j + W <= n; j += W) {
+                Vec::storeInt16(dst + j, Vec::min(Vec::max(Vec::mul(Vec::load(src + j), s), lo), hi));
+            }
+            for (; j < n; ++j) {
+                dst[j] = quantizeWeight(src[j], scale, limit);
+            }
+        }
+
+        static void clampScale(float* x, float lo, float hi, float scale, int n) {
+            const V l = Vec::set1(lo);
+            const V h = Vec::set1(hi);
+            const V s = Vec::set1(scale);
+
+            int j = 0;
+            for (; j + W <= n; j += W) {
+                Vec::store(x + j, Vec::mul(Vec::min(Vec::max(Vec::load(x + j), l), h), s));
+            }
+            for (; j < n; ++j) {
+                x[j] = (x[j] < lo ? lo : x[j] > hi ? hi : x[j]) * scale;
+            }
+        }
+
+        static void toBf16(std::uint16_t* dst, const float* src, int n) {
+            int j = 0;
+            for (; j + W <= n; j += W) {
+                Vec::storeBf16Nearest(dst + j, Vec::load(src + j));
+            }
+            for (; j < n; ++j) {
+                dst[j] = floatToBf16(src[j]);
+            }
+        }
+
+        static void relu(float* x, int n) {
+            const V zero = Vec::zero();
+
+            int j = 0;
+            for (; j + W <= n; j += W) {
+                Vec::store(x + j, Vec::max(Vec::load(x + j), zero));
+            }
+            for (; j < n; ++j) {
+                x[j] = x[j] > 0 ? x[j] : 0;
+            }
+        }
+
+        static float dot(const float* a, const float* b, int n) {
+            V sum0 = Vec::zero();
+            V sum1 = Vec::zero();
+
+            int j = 0;
+            for (; j + 2 * W <= n; j += 2 * W) {
+                sum0 = Vec::fmadd(Vec::load(a + j), Vec::load(b + j), sum0);
+                sum1 = Vec::fmadd(Vec::load(a + j + W), Vec::load(b + j + W), sum1);
+            }
+            for (; j + W <= n; j += W) {
+                sum0 = Vec::fmadd(Vec::load(a + j), Vec::load(b + j), sum0);
+            }
+
+            float sum = Vec::reduce(Vec::add(sum0, sum1));
+            for (; j < n; ++j) {
+                sum += a[j] * b[j];
+            }
+            return sum;
+        }
+
+        static void addRow(float* dst, const float* src, int n) {
+            int j = 0;
+            for (; j + W <= n; j += W) {
+                Vec::store(dst + j, Vec::add(Vec::load(dst + j), Vec::load(src + j)));
+            }
+            for (; j < n; ++j) {
+                dst[j] += src[j];
+            }
+        }
+
+        static void scatter(float* grads, int gradStride, const std::int16_t* rows, int rowStride, int count, const float* src, int n) {
+            int j = 0;
+
+            for (; j + TILE <= n; j += TILE) {
+                V values[8];
+                for (int k = 0; k < 8; ++k) {
+                    values[k] = Vec::load(src + j + k * W);
+                }
+
+                for (int i = 0; i < count; ++i) {
+                    float* row = grads + rows[i * rowStride] * gradStride + j;
+                    for (int k = 0; k < 8; ++k) {
+                        Vec::store(row + k * W, Vec::add(Vec::load(row + k * W), values[k]));
+                    }
+                }
+            }
+
+            for (; j + W <= n; j += W) {
+                const V value = Vec::load(src + j);
+                for (int i = 0; i < count; ++i) {
+                    float* row = grads + rows[i * rowStride] * gradStride + j;
+                    Vec::store(row, Vec::add(Vec::load(row), value));
+                }
+            }
+
+            for (; j < n; ++j) {
+                for (int i = 0; i < count; ++i) {
+                    grads[rows[i * rowStride] * gradStride + j] += src[j];
+                }
+            }
+        }
+
+        static void axpy(float* dst, float a, const float* x, int n) {
+            const V va = Vec::set1(a);
+
+            int j = 0;
+            for (; j + W <= n; j += W) {
+                Vec::store(dst + j, Vec::fmadd(va, Vec::load(x + j), Vec::load(dst + j)));
+            }
+            for (; j < n; ++j) {
+                dst[j] += a * x[j];
+            }
+        }
+
+        static void reluBackward(float* out, float a, const float* w, const float* acc, int n) {
+            const V va = Vec::set1(a);
+
+            int j = 0;
+            for (; j + W <= n; j += W) {
+                Vec::store(out + j, Vec::positiveOnly(Vec::load(acc + j), Vec::mul(va, Vec::load(w + j))));
+            }
+            for (; j < n; ++j) {
+                out[j] = acc[j] > 0 ? a * w[j] : 0;
+            }
+        }
+
+        // Vec interface for the columns left over after the last full
+        // register, and for moment formats the instruction set can't convert
+        struct Scalar {
+            using type = float;
+
+            static constexpr bool bf16 = true;
+            static constexpr bool fp16 = true;
+
+            // xorshift32, the random bits for stochastic rounding
+            struct Random {
+                std::uint32_t state;
+
+                explicit Random(std::uint32_t seed) : state(seed | 1) {
+                }
+
+                std::uint32_t next() {
+                    state ^= state << 13;
+                    state ^= state >> 17;
+                    state ^= state << 5;
+                    return state;
+                }
+            };
+
+            static type load(const float* p) {
+                return *p;
+            }
+            static void store(float* p, type v) {
+                *p = v;
+            }
+            static type loadBf16(const std::uint16_t* p) {
+                return bf16ToFloat(*p);
+            }
+            static void storeBf16(std::uint16_t* p, type v, std::uint32_t random) {
+                *p = static_cast<std::uint16_t>((floatBits(v) + (random & 0xFFFF)) >> 16);
+            }
+            static type loadFp16(const std::uint16_t* p) {
+                return fp16ToFloat(*p);
+            }
+            static void storeFp16(std::uint16_t* p, type v, std::uint32_t random) {
+                *p = floatToFp16Stochastic(v, random);
+            }
+            static type zero() {
+                return 0.0f;
+            }
+            static type set1(float x) {
+                return x;
+            }
+            static type add(type a, type b) {
+                return a + b;
+            }
+            static type mul(type a, type b) {
+                return a * b;
+            }
+            static type div(type a, type b) {
+                return a / b;
+            }
+            static type max(type a, type b) {
+                return a > b ? a : b;
+            }
+            static type fmadd(type a, type b, type c) {
+                return a * b + c;
+            }
+            static type sqrt(type a) {
+                return __builtin_sqrtf(a);
+            }
+            static type abs(type a) {
+                return __builtin_fabsf(a);
+            }
+        };
+
+        template <typename Ops, MomentStorage S>
+        static typename Ops::type loadMoment(const void* p, int j) {
+            if constexpr (S == MomentStorage::FP32) {
+                return Ops::load(static_cast<const float*>(p) + j);
+            } else if constexpr (S == MomentStorage::BF16) {
+                return Ops::loadBf16(static_cast<const std::uint16_t*>(p) + j);
+            } else {
+                return Ops::loadFp16(static_cast<const std::uint16_t*>(p) + j);
+            }
+        }
+
+        template <typename Ops, MomentStorage S>
+        static void storeMoment(void* p, int j, typename Ops::type x, typename Ops::Random& random) {
+            if constexpr (S == MomentStorage::FP32) {
+                Ops::store(static_cast<float*>(p) + j, x);
+            } else if constexpr (S == MomentStorage::BF16) {
+                Ops::storeBf16(static_cast<std::uint16_t*>(p) + j, x, random.next());
+            } else {
+                Ops::storeFp16(static_cast<std::uint16_t*>(p) + j, x, random.next());
+            }
+        }
+
+        template <typename Ops, Optimizer O, MomentStorage S>
+        static void updateLanes(const OptimizerParams& p, float* w, void* m, void* v, float* const* grads, int count, int j, typename Ops::Random& random) {
+            using T = typename Ops::type;
+
+            T g = Ops::zero();
+            for (int t = 0; t < count; ++t) {
+                g = Ops::add(g, Ops::load(grads[t] + j));
+                Ops::store(grads[t] + j, Ops::zero());
+            }
+
+            const T negLr  = Ops::set1(-p.lr);
+            T       weight = Ops::load(w + j);
+
+            if constexpr (O == Optimizer::SGD) {
+                weight = Ops::fmadd(negLr, g, weight);
+            } else if constexpr (O == Optimizer::Momentum) {
+                const T moment = Ops::fmadd(Ops::set1(p.beta1), loadMoment<Ops, S>(m, j), g);
+                storeMoment<Ops, S>(m, j, moment, random);
+
+                weight = Ops::fmadd(negLr, moment, weight);
+            } else {
+                const T first = Ops::fmadd(Ops::set1(p.beta1), loadMoment<Ops, S>(m, j), Ops::mul(Ops::set1(1 - p.beta1), g));
+                storeMoment<Ops, S>(m, j, first, random);
+
+                T denominator;
+                if constexpr (O == Optimizer::Adamax) {
+                    const T second = Ops::max(Ops::mul(Ops::set1(p.beta2), loadMoment<Ops, S>(v, j)), Ops::abs(g));
+                    storeMoment<Ops, S>(v, j, second, random);
+                    denominator = Ops::add(second, Ops::set1(p.epsilon));
+                } else {
+                    const T second = Ops::fmadd(Ops::set1(p.beta2), loadMoment<Ops, S>(v, j), Ops::mul(Ops::set1(1 - p.beta2), Ops::mul(g, g)));
+                    storeMoment<Ops, S>(v, j, second, random);
+                    denominator = Ops::add(Ops::sqrt(second), Ops::set1(p.epsilon));
+                }
+
+                T delta = Ops::div(first, denominator);
+                if constexpr (O == Optimizer::AdamW) {
+                    delta = Ops::fmadd(Ops::set1(p.decay), weight, delta);
+                }
+
+                weight = Ops::fmadd(negLr, delta, weight);
+            }
+
+            Ops::store(w + j, weight);
+        }
+
+        template <MomentStorage S, Optimizer O>
+        static void update(const OptimizerParams& params, float* weights, void* m, void* v, float* const* grads, int count, int n, std::uint32_t seed) {
+            constexpr bool vectorized = S == MomentStorage::FP32 || (S == MomentStorage::BF16 && Vec::bf16) || (S == MomentStorage::FP16 && Vec::fp16);
+
+            int j = 0;
+
+            if constexpr (vectorized) {
+                typename Vec::Random random(seed);
+                for (; j + W <= n; j += W) {
+                    updateLanes<Vec, O, S>(params, weights, m, v, grads, count, j, random);
+                }
+            }
+
+            typename Scalar::Random random(seed ^ 0x9E3779B9u);
+            for (; j < n; ++j) {
+                updateLanes<Scalar, O, S>(params, weights, m, v, grads, count, j, random);
+            }
+        }
+
+        static constexpr Kernels table(const char* name) {
+            return Kernels{
+                name,
+                &accumulate,
+                &accumulateBf16,
+                &toBf16,
+                &accumulateInt16,
+                &quantize,
+                &clampScale,
+                &relu,
+                &dot,
+                &addRow,
+                &scatter,
+                &axpy,
+                &reluBackward,
+                {
+                    {
+                        &update<MomentStorage::FP32, Optimizer::SGD>,
+                        &update<MomentStorage::FP32, Optimizer::Momentum>,
+                        &update<MomentStorage::FP32, Optimizer::Adam>,
+                        &update<MomentStorage::FP32, Optimizer::AdamW>,
+                        &update<MomentStorage::FP32, Optimizer::Adamax>,
+                    },
+                    {
+                        &update<MomentStorage::BF16, Optimizer::SGD>,
+                        &update<MomentStorage::BF16, Optimizer::Momentum>,
+                        &update<MomentStorage::BF16, Optimizer::Adam>,
+                        &update<MomentStorage::BF16, Optimizer::AdamW>,
+                        &update<MomentStorage::BF16, Optimizer::Adamax>,
+                    },
+                    {
+                        &update<MomentStorage::FP16, Optimizer::SGD>,
+                        &update<MomentStorage::FP16, Optimizer::Momentum>,
+                        &update<MomentStorage::FP16, Optimizer::Adam>,
+                        &update<MomentStorage::FP16, Optimizer::AdamW>,
+                        &update<MomentStorage::FP16, Optimizer::Adamax>,
+                    },
+                },
+            };
+        }
+    };
+
+} // namespace Simd
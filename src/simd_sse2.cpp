@@ -0,0 +1,184 @@
+// Baseline kernels: SSE2 on x86-64, plain scalar code everywhere else.
+#include "simd_kernels.h"
+
+#if defined(__SSE2__)
+    #include <emmintrin.h>
+#endif
+
+namespace {
+#if defined(__SSE2__)
+    struct Vec {
+        using type                 = __m128;
+        static constexpr int width = 4;
+
+        // fp16 moments go through the scalar path, SSE2 has no conversion
+        static constexpr bool bf16 = true;
+        static constexpr bool fp16 = false;
+
+        // One xorshift32 stream per lane
+        struct Random {
+            __m128i state;
+
+            explicit Random(std::uint32_t seed) {
+                alignas(16) std::uint32_t lanes[width];
+                for (int i = 0; i < width; ++i) {
+                    lanes[i] = (seed ^ (i + 1) * 0x9E3779B9u) | 1;
+                }
+                state = _mm_load_si128(reinterpret_cast<const __m128i*>(lanes));
+            }
+
+            __m128i next() {
+                state = _mm_xor_si128(state, _mm_slli_epi32(state, 13));
+                state = _mm_xor_si128(state, _mm_srli_epi32(state, 17));
+                state = _mm_xor_si128(state, _mm_slli_epi32(state, 5));
+                return state;
+            }
+        };
+
+        static type load(const float* p) {
+            return _mm_loadu_ps(p);
+        }
+        static void store(float* p, type v) {
+            _mm_storeu_ps(p, v);
+        }
+        static type loadBf16(const std::uint16_t* p) {
+            return _mm_castsi128_ps(_mm_unpacklo_epi16(_mm_setzero_si128(), _mm_loadl_epi64(reinterpret_cast<const __m128i*>(p))));
+        }
+        static void storeBf16(std::uint16_t* p, type v, __m128i random) {
+            const __m128i bits = _mm_srli_epi32(_mm_add_epi32(_mm_castps_si128(v), _mm_and_si128(random, _mm_set1_epi32(0xFFFF))), 16);
+
+            // Sign extend so the signed saturating pack keeps all 16 bits
+            const __m128i extended = _mm_srai_epi32(_mm_slli_epi32(bits, 16), 16);
+            _mm_storel_epi64(reinterpret_cast<__m128i*>(p), _mm_packs_epi32(extended, extended));
+        }
+        // Rounds to nearest even, the same as floatToBf16
+        static void storeBf16Nearest(std::uint16_t* p, type v) {
+            const __m128i odd = _mm_and_si128(_mm_srli_epi32(_mm_castps_si128(v), 16), _mm_set1_epi32(1));
+            storeBf16(p, v, _mm_add_epi32(_mm_set1_epi32(0x7FFF), odd));
+        }
+        static type loadInt16(const std::int16_t* p) {
+            return _mm_cvtepi32_ps(_mm_srai_epi32(_mm_unpacklo_epi16(_mm_setzero_si128(), _mm_loadl_epi64(reinterpret_cast<const __m128i*>(p))), 16));
+        }
+        // Rounds to nearest, v has to be in the int16 range
+        static void storeInt16(std::int16_t* p, type v) {
+            const __m128i x = _mm_cvtps_epi32(v);
+            _mm_storel_epi64(reinterpret_cast<__m128i*>(p), _mm_packs_epi32(x, x));
+        }
+        static type zero() {
+            return _mm_setzero_ps();
+        }
+        static type set1(float x) {
+            return _mm_set1_ps(x);
+        }
+        static type add(type a, type b) {
+            return _mm_add_ps(a, b);
+        }
+        static type mul(type a, type b) {
+            return _mm_mul_ps(a, b);
+        }
+        static type div(type a, type b) {
+            return _mm_div_ps(a, b);
+        }
+        static type max(type a, type b) {
+            return _mm_max_ps(a, b);
+        }
+        static type min(type a, type b) {
+            return _mm_min_ps(a, b);
+        }
+        static type fmadd(type a, type b, type c) {
+            return _mm_add_ps(_mm_mul_ps(a, b), c);
+        }
+        static type sqrt(type a) {
+            return _mm_sqrt_ps(a);
+        }
+        static type abs(type a) {
+            return _mm_andnot_ps(_mm_set1_ps(-0.0f), a);
+        }
+        static type positiveOnly(type mask, type v) {
+            return _mm_and_ps(_mm_cmpgt_ps(mask, _mm_setzero_ps()), v);
+        }
+        static float reduce(type v) {
+            const __m128 sum64 = _mm_add_ps(v, _mm_movehl_ps(v, v));
+            const __m128 sum32 = _mm_add_ss(sum64, _mm_shuffle_ps(sum64, sum64, 0x55));
+            return _mm_cvtss_f32(sum32);
+        }
+    };
+
+    constexpr Simd::Kernels table = Simd::KernelSet<Vec>::table("sse2");
+#else
+    struct Vec {
+        using type                 = float;
+        static constexpr int width = 1;
+
+        // 16 bit moments go through the scalar path
+        static constexpr bool bf16 = false;
+        static constexpr bool fp16 = false;
+
+        struct Random {
+            explicit Random(std::uint32_t) {
+            }
+        };
+
+        static type load(const float* p) {
+            return *p;
+        }
+        static void store(float* p, type v) {
+            *p = v;
+        }
+        static type loadBf16(const std::uint16_t* p) {
+            return bf16ToFloat(*p);
+        }
+        static void storeBf16Nearest(std::uint16_t* p, type v) {
+            *p = floatToBf16(v);
+        }
+        static type loadInt16(const std::int16_t* p) {
+            return *p;
+        }
+        static void storeInt16(std::int16_t* p, type v) {
+            *p = static_cast<std::int16_t>(__builtin_nearbyintf(v));
+        }
+        static type zero() {
+            return 0.0f;
+        }
+        static type set1(float x) {
+            return x;
+        }
+        static type add(type a, type b) {
+            return a + b;
+        }
+        static type mul(type a, type b) {
+            return a * b;
+        }
+        static type div(type a, type b) {
+            return a / b;
+        }
+        static type max(type a, type b) {
+            return a > b ? a : b;
+        }
+        static type min(type a, type b) {
+            return a < b ? a : b;
+        }
+        static type fmadd(type a, type b, type c) {
+            return a * b + c;
+        }
+        static type sqrt(type a) {
+            return __builtin_sqrtf(a);
+        }
+        static type abs(type a) {
+            return __builtin_fabsf(a);
+        }
+        static type positiveOnly(type mask, type v) {
+            return mask > 0 ? v : 0.0f;
+        }
+        static float reduce(type v) {
+            return v;
+        }
+    };
+
+    constexpr Simd::Kernels table = Simd::KernelSet<Vec>::table("scalar");
+#endif
+} // namespace
+
+const Simd::Kernels* Simd::sse2Kernels() {
+    return &table;
+}
@@ -0,0 +1,135 @@
+#include "threadpool.h"
+
+#include <algorithm>
+
+#if defined(__linux__)
+    #include <pthread.h>
+    #include <sched.h>
+#endif
+
+#if defined(__x86_64__) || defined(__i386__)
+    #include <immintrin.h>
+#endif
+
+namespace {
+    constexpr int SPIN_ITERATIONS = 4096;
+
+    inline void cpuRelax() {
+#if defined(__x86_64__) || defined(__i386__)
+        _mm_pause();
+#endif
+    }
+
+    // CPUs the process may run on, which can be fewer than the machine has
+    // under taskset, cgroups or a container. Empty where it can't be queried.
+    std::vector<int> allowedCores() {
+        std::vector<int> cores;
+#if defined(__linux__)
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        if (sched_getaffinity(0, sizeof(cpu_set_t), &set) == 0) {
+            for (int core = 0; core < CPU_SETSIZE; ++core) {
+                if (CPU_ISSET(core, &set)) {
+                    cores.push_back(core);
+                }
+            }
+        }
+#endif
+        return cores;
+    }
+
+    void pinToCore(std::thread& thread, const int core) {
+#if defined(__linux__)
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET(core, &set);
+        pthread_setaffinity_np(thread.native_handle(), sizeof(cpu_set_t), &set);
+#else
+        (void) thread;
+        (void) core;
+#endif
+    }
+
+    // Spinning only pays off when every worker has a core of its own
+    int spinIterations(const int threads) {
+        const std::size_t allowed = allowedCores().size();
+        const std::size_t cores   = allowed > 0 ? allowed : std::thread::hardware_concurrency();
+        return static_cast<std::size_t>(threads) <= cores ? SPIN_ITERATIONS : 0;
+    }
+} // namespace
+
+void SpinBarrier::wait() {
+    const std::uint32_t gen = generation.load(std::memory_order_acquire);
+
+    if (arrived.fetch_add(1, std::memory_order_acq_rel) == count - 1) {
+        arrived.store(0, std::memory_order_relaxed);
+        generation.fetch_add(1, std::memory_order_release);
+        generation.notify_all();
+        return;
+    }
+
+    for (int i = 0; i < spins; ++i) {
+        if (generation.load(std::memory_order_acquire) != gen) {
+            return;
+        }
+        cpuRelax();
+    }
+
+    while (generation.load(std::memory_order_acquire) == gen) {
+        generation.wait(gen, std::memory_order_acquire);
+    }
+}
+
+ThreadPool::ThreadPool(const int _threads)
+    : startBarrier(_threads, spinIterations(_threads)), phaseBarrier(_threads, spinIterations(_threads)), doneBarrier(_threads, spinIterations(_threads)), threads(_threads) {
+    for (int threadId = 1; threadId < threads; ++threadId) {
+        workers.emplace_back(&ThreadPool::workerLoop, this, threadId);
+    }
+}
+
+void ThreadPool::pin() {
+    const std::vector<int> cores = allowedCores();
+
+    if (cores.empty()) {
+        return;
+    }
+
+    // Worker 0 is the calling thread, it is left unpinned since the data
+    // loader threads it spawns would inherit its affinity.
+    for (int threadId = 1; threadId < threads; ++threadId) {
+        pinToCore(workers[threadId - 1], cores[threadId % cores.size()]);
+    }
+}
+
+ThreadPool::~ThreadPool() {
+    stopping = true;
+    startBarrier.wait();
+
+    for (auto& worker : workers) {
+        worker.join();
+    }
+}
+
+void ThreadPool::workerLoop(const int threadId) {
+    for (;;) {
+        startBarrier.wait();
+
+        if (stopping) {
+            return;
+        }
+
+        (*job)(threadId);
+
+        doneBarrier.wait();
+    }
+}
+
+void ThreadPool::run(const std::function<void(int)>& _job) {
+    job = &_job;
+    startBarrier.wait();
+
+    _job(0);
+
+    doneBarrier.wait();
+    job = nullptr;
+}
@@ -0,0 +1,75 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <functional>
+#include <thread>
+#include <vector>
+
+// Barrier that spins for a short while before parking on the atomic, so
+// back to back phases don't pay for a futex wake while oversubscribed
+// machines don't burn cores spinning.
+class SpinBarrier {
+private:
+    std::atomic<int>           arrived{0};
+    std::atomic<std::uint32_t> generation{0};
+    int                        count;
+    int                        spins;
+
+public:
+    SpinBarrier(const int _count, const int _spins) : count(_count), spins(_spins) {
+    }
+
+    void wait();
+};
+
+// Persistent worker pool owned by the trainer. Workers stay alive for the
+// whole run, run() hands them one job per batch which can be split into
+// phases with barrier(). The data loader keeps one for its decoders.
+class ThreadPool {
+private:
+    std::vector<std::thread>        workers;
+    SpinBarrier                     startBarrier;
+    SpinBarrier                     phaseBarrier;
+    SpinBarrier                     doneBarrier;
+    const std::function<void(int)>* job      = nullptr;
+    bool                            stopping = false;
+    int                             threads;
+
+    void workerLoop(const int threadId);
+
+public:
+    explicit ThreadPool(const int _threads);
+    ~ThreadPool();
+
+    ThreadPool(const ThreadPool&)            = delete;
+    ThreadPool& operator=(const ThreadPool&) = delete;
+
+    // Runs job(threadId) on every worker and returns once all of them are
+    // done. The calling thread takes part as worker 0.
+    void run(const std::function<void(int)>& _job);
+
+    // Pins every worker but the calling thread to a CPU of its own, taken
+    // from the CPUs the process may run on. The loader threads aren't pinned
+    // and share those CPUs.
+    void pin();
+
+    // Waits for all workers, only valid inside a job
+    void barrier() {
+        phaseBarrier.wait();
+    }
+
+    int size() const {
+        return threads;
+    }
+
+    struct Range {
+        int begin;
+        int end;
+    };
+
+    // The share of [0, n) processed by threadId
+    Range range(const int n, const int threadId) const {
+        return {static_cast<int>(static_cast<long long>(n) * threadId / threads), static_cast<int>(static_cast<long long>(n) * (threadId + 1) / threads)};
+    }
+};
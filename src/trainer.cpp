@@ -1,7 +1,11 @@
 #include "trainer.h"
 #include "nn.h"
+#include "checkpoint.h"
 #include "optimizer.h"
-#include <omp.h>
+#include "quantize.h"
+#include "simd.h"
+#include <algorithm>
+#include <cstring>
 
 #define EPOCH_ERROR epochError / static_cast<double>(dataSetLoader.batchSize * batchIterations)
 
@@ -15,198 +19,927 @@ inline float errorGradient(float output, float eval, float wdl) {
     return 2 * (sigmoid(output) - expected);
 }
 
-void Trainer::loadFeatures(DataLoader::DataSetEntry& entry, Features& features) {
-    const chess::Position& pos    = entry.entry.pos;
-    chess::Bitboard        pieces = pos.piecesBB();
+void Trainer::batch(const int threadId) {
+    const Simd::Kernels& simd = Simd::kernels();
 
-    const chess::Square ksq_White = pos.kingSquare(chess::Color::White);
-    const chess::Square ksq_Black = pos.kingSquare(chess::Color::Black);
+    const DataLoader::Batch& data         = dataSetLoader.getBatch();
+    const bool               featureMajor = backwardMode == BackwardMode::FeatureMajor;
 
-    for (chess::Square sq : pieces) {
-        const chess::Piece piece      = pos.pieceAt(sq);
-        const std::uint8_t pieceType  = static_cast<uint8_t>(piece.type());
-        const std::uint8_t pieceColor = static_cast<uint8_t>(piece.color());
+    const auto [begin, end] = pool.range(static_cast<int>(data.size), threadId);
 
-        const int featureW = inputIndex(pieceType, pieceColor, static_cast<int>(sq), static_cast<uint8_t>(chess::Color::White), static_cast<int>(ksq_White));
-        const int featureB = inputIndex(pieceType, pieceColor, static_cast<int>(sq), static_cast<uint8_t>(chess::Color::Black), static_cast<int>(ksq_Black));
+    losses[threadId] = 0;
 
-        features.add(featureW, featureB);
-    }
-}
-
-void        Trainer::batch() {
-#pragma omp parallel for schedule(static) num_threads(THREADS)
-    for (int batchIdx = 0; batchIdx < dataSetLoader.batchSize; batchIdx++) {
-        const int threadId = omp_get_thread_num();
-
-        // Load the current batch entry
-        DataLoader::DataSetEntry& entry = dataSetLoader.getEntry(batchIdx);
+    for (int batchIdx = begin; batchIdx < end; batchIdx++) {
+        // Features were built by the loader, side to move first
+        const std::int16_t* stmFeatures  = data.stmFeatures.data() + data.offsets[batchIdx];
+        const std::int16_t* nstmFeatures = data.nstmFeatures.data() + data.offsets[batchIdx];
+        const int           count        = data.featureCount(batchIdx);
 
         NN::Accumulator accumulator;
-        NN::Color       stm = NN::Color(entry.sideToMove());
-        Features        featureset;
-
-        loadFeatures(entry, featureset);
 
-        const auto eval = entry.score();
-        const auto wdl  = entry.wdl();
+        const auto eval = data.eval[batchIdx];
+        const auto wdl  = data.wdl[batchIdx];
 
         //--- Forward Pass ---//
-        const float output = nn.forward(accumulator, featureset, stm);
+        const float output = nn.forward(accumulator, stmFeatures, nstmFeatures, count);
 
         losses[threadId] += errorFunction(output, eval, wdl);
 
         //--- Backward Pass ---//
-        BatchGradients& gradients = batchGradients[threadId];
-        const float outGradient = errorGradient(output, eval, wdl) * sigmoidPrime(output);
+        BatchGradients& gradients   = batchGradients[threadId];
+        const float     outGradient = errorGradient(output, eval, wdl) * sigmoidPrime(output);
 
         // Hidden bias
         gradients.hiddenBias[0] += outGradient;
 
         // Hidden features
-        for (int i = 0; i < HIDDEN_SIZE * 2; ++i) {
-            gradients.hiddenFeatures[i] += outGradient * accumulator[i];
-        }
+        simd.axpy(gradients.hiddenFeatures.data(), outGradient, accumulator.data(), HIDDEN_SIZE * 2);
 
-        std::array<float, HIDDEN_SIZE * 2> hiddenLosses;
+        // Feature-major mode keeps the hidden losses for the bucketed pass
+        std::array<float, HIDDEN_SIZE * 2> localLosses;
+        float* hiddenLosses = featureMajor ? sampleLosses.data() + static_cast<std::size_t>(batchIdx) * HIDDEN_SIZE * 2 : localLosses.data();
 
-        for (int i = 0; i < HIDDEN_SIZE * 2; ++i){
-            hiddenLosses[i] = outGradient * nn.hiddenFeatures[i] * ReLUPrime(accumulator[i]);
-        }
+        simd.reluBackward(hiddenLosses, outGradient, nn.hiddenFeatures.data(), accumulator.data(), HIDDEN_SIZE * 2);
 
         // Input bias
-        for (int i = 0; i < HIDDEN_SIZE; ++i){
-            gradients.inputBias[i] += hiddenLosses[i] + hiddenLosses[i + HIDDEN_SIZE];
+        simd.addRow(gradients.inputBias.data(), hiddenLosses, HIDDEN_SIZE);
+        simd.addRow(gradients.inputBias.data(), hiddenLosses + HIDDEN_SIZE, HIDDEN_SIZE);
+
+        if (featureMajor) {
+            continue;
         }
 
         // Input features
-        for (int i = 0; i < featureset.n;++i){
-            int f1 = featureset.features[i][stm];
-            int f2 = featureset.features[i][!stm];
+        for (int i = 0; i < count; ++i) {
+            gradients.markActive(stmFeatures[i]);
+            gradients.markActive(nstmFeatures[i]);
+        }
+
+        simd.scatter(gradients.inputFeatures.data(), HIDDEN_SIZE, stmFeatures, 1, count, hiddenLosses, HIDDEN_SIZE);
+        simd.scatter(gradients.inputFeatures.data(), HIDDEN_SIZE, nstmFeatures, 1, count, hiddenLosses + HIDDEN_SIZE, HIDDEN_SIZE);
+    }
+}
 
-            for (int j = 0; j < HIDDEN_SIZE; ++j){
-                gradients.inputFeatures[f1 * HIDDEN_SIZE + j] += hiddenLosses[j];
-                gradients.inputFeatures[f2 * HIDDEN_SIZE + j] += hiddenLosses[j + HIDDEN_SIZE];
+// Counting sort of the batch's (feature, sample, perspective) triples by
+// feature. Every thread counts and later places the pairs of its own
+// samples, so the buckets come out ordered by sample within each feature.
+void Trainer::bucketFeatures(const int threadId) {
+    const DataLoader::Batch& data = dataSetLoader.getBatch();
+
+    const auto [begin, end] = pool.range(static_cast<int>(data.size), threadId);
+
+    std::array<int, INPUT_SIZE>& counts = featureCounts[threadId];
+    counts.fill(0);
+
+    for (std::uint32_t i = data.offsets[begin]; i < data.offsets[end]; ++i) {
+        counts[data.stmFeatures[i]]++;
+        counts[data.nstmFeatures[i]]++;
+    }
+
+    pool.barrier();
+
+    // Turn the counts into each thread's first slot in every bucket
+    if (threadId == 0) {
+        int offset = 0;
+        for (int feature = 0; feature < INPUT_SIZE; ++feature) {
+            bucketStart[feature] = offset;
+            for (auto& threadCounts : featureCounts) {
+                const int count       = threadCounts[feature];
+                threadCounts[feature] = offset;
+                offset += count;
             }
         }
+        bucketStart[INPUT_SIZE] = offset;
+    }
+
+    pool.barrier();
+
+    for (int sample = begin; sample < end; ++sample) {
+        for (std::uint32_t i = data.offsets[sample]; i < data.offsets[sample + 1]; ++i) {
+            featureSamples[counts[data.stmFeatures[i]]++]  = sample << 1;
+            featureSamples[counts[data.nstmFeatures[i]]++] = sample << 1 | 1;
+        }
     }
+
+    pool.barrier();
 }
 
-void Trainer::applyGradients() {
+// Sums the hidden losses of every sample the feature was active in,
+// returns false if it wasn't active at all
+bool Trainer::gatherRow(const int feature, float* gradientSum) {
+    const Simd::Kernels& simd = Simd::kernels();
 
-#pragma omp parallel for schedule(static) num_threads(THREADS)
-    for (int i = 0; i < INPUT_SIZE * HIDDEN_SIZE; ++i){
-        float gradientSum = 0;
+    for (int i = bucketStart[feature]; i < bucketStart[feature + 1]; ++i) {
+        const std::uint32_t pair = featureSamples[i];
+        simd.addRow(gradientSum, sampleLosses.data() + (pair >> 1) * HIDDEN_SIZE * 2 + (pair & 1) * HIDDEN_SIZE, HIDDEN_SIZE);
+    }
 
-        for (int j = 0; j < THREADS; ++j){
-            gradientSum += batchGradients[j].inputFeatures[i];
+    return bucketStart[feature] != bucketStart[feature + 1];
+}
+
+// Input rows updated by threadId. Feature-major mode splits the rows so
+// every thread gathers about the same number of samples.
+ThreadPool::Range Trainer::rowRange(const int threadId) const {
+    if (backwardMode != BackwardMode::FeatureMajor) {
+        return pool.range(INPUT_SIZE, threadId);
+    }
+
+    const long long total = bucketStart[INPUT_SIZE];
+
+    auto boundary = [&](const int t) {
+        if (t == pool.size()) {
+            return INPUT_SIZE;
         }
+        const int target = static_cast<int>(total * t / pool.size());
+        return static_cast<int>(std::lower_bound(bucketStart.begin(), bucketStart.end() - 1, target) - bucketStart.begin());
+    };
+
+    return {boundary(threadId), boundary(threadId + 1)};
+}
+
+// Runs the optimizer on elements [offset, offset + n) of a layer with the
+// sum of the given gradient rows, which are cleared on the way
+void Trainer::optimize(float* weights, Moments& moments, const std::size_t offset, float* const* grads, const int count, const int n) {
+    // Fresh rounding noise for every call, only 16 bit moments use it
+    const std::uint32_t seed = moments.storage == MomentStorage::FP32 ? 0 : roundingSeed.fetch_add(0x9E3779B9u, std::memory_order_relaxed);
 
-        adamUpdate(nn.inputFeatures[i], nnGradients.inputFeatures[i], gradientSum, learningRate);
+    Simd::kernels().update[static_cast<int>(moments.storage)][static_cast<int>(optimizer)](optimizerParams(), weights + offset, moments.m(offset), moments.v(offset), grads, count, n, seed);
+}
+
+// Applies the steps an input row skipped, for columns [column, column + n)
+void Trainer::catchUpRow(const int feature, const int column, const int n, const std::uint64_t skipped) {
+    if (skipped == 0) {
+        return;
     }
 
-#pragma omp parallel for schedule(static) num_threads(THREADS)
-    for (int i = 0; i < HIDDEN_SIZE; ++i){
-        float gradientSum = 0;
+    const std::size_t offset = static_cast<std::size_t>(feature) * HIDDEN_SIZE + column;
 
-        for (int j = 0; j < THREADS; ++j){
-            gradientSum += batchGradients[j].inputBias[i];
+    std::array<float, HIDDEN_SIZE> m;
+    std::array<float, HIDDEN_SIZE> v;
+
+    Moments& moments = nnGradients.inputFeatures;
+    moments.read(offset, n, m.data(), v.data());
+    catchUp(optimizer, optimizerParams(), nn.inputFeatures.data() + offset, m.data(), v.data(), n, skipped);
+    moments.write(offset, n, m.data(), v.data());
+}
+
+// Every thread owns a slice of each layer. The update kernels sum the
+// slice over all the per-thread gradients, clear it for the next batch and
+// run the optimizer in one pass, so no separate clear pass or serial
+// section is needed.
+void Trainer::applyGradients(const int threadId) {
+    const std::uint64_t step = nnGradients.step;
+
+    std::vector<float*> grads;
+    grads.reserve(pool.size());
+
+    // The slice [offset, offset + n) of a layer in every thread's gradients
+    auto slices = [&](auto member, const int offset) {
+        grads.clear();
+        for (auto& grad : batchGradients) {
+            grads.push_back((grad.*member).data() + offset);
         }
+        return grads.data();
+    };
+
+    // --- Input Features ---//
+    const auto [rowBegin, rowEnd] = rowRange(threadId);
+
+    // Feature-major rows are gathered here, the kernel clears it after use
+    alignas(64) std::array<float, HIDDEN_SIZE> gradientSum{};
+
+    for (int feature = rowBegin; feature < rowEnd; ++feature) {
+        const int offset = feature * HIDDEN_SIZE;
 
-        adamUpdate(nn.inputBias[i], nnGradients.inputBias[i], gradientSum, learningRate);
+        grads.clear();
+
+        if (backwardMode == BackwardMode::FeatureMajor) {
+            if (gatherRow(feature, gradientSum.data())) {
+                grads.push_back(gradientSum.data());
+            }
+        } else {
+            for (auto& grad : batchGradients) {
+                if (grad.activeRows[feature]) {
+                    grads.push_back(grad.inputFeatures.data() + offset);
+                    grad.activeRows[feature] = false;
+                }
+            }
+        }
+
+        // Rows without a gradient only need the optimizer in dense mode
+        if (grads.empty() && (sparseInputGradients || lazyAdam)) {
+            continue;
+        }
+
+        if (lazyAdam) {
+            catchUpRow(feature, 0, HIDDEN_SIZE, step - 1 - nnGradients.rowSteps[feature]);
+            nnGradients.rowSteps[feature] = step;
+        }
+
+        optimize(nn.inputFeatures.data(), nnGradients.inputFeatures, offset, grads.data(), static_cast<int>(grads.size()), HIDDEN_SIZE);
+        nn.refreshShadow(offset, HIDDEN_SIZE);
     }
 
-    
+    // --- Input Bias ---//
+    const auto [biasBegin, biasEnd] = pool.range(HIDDEN_SIZE, threadId);
+
+    optimize(nn.inputBias.data(), nnGradients.inputBias, biasBegin, slices(&BatchGradients::inputBias, biasBegin), pool.size(), biasEnd - biasBegin);
+
     // --- Hidden Features ---//
-#pragma omp parallel for schedule(static) num_threads(THREADS)
-    for (int i = 0; i < HIDDEN_SIZE * 2; ++i){
-        float gradientSum = 0;
+    const auto [hiddenBegin, hiddenEnd] = pool.range(HIDDEN_SIZE * 2, threadId);
+
+    optimize(nn.hiddenFeatures.data(), nnGradients.hiddenFeatures, hiddenBegin, slices(&BatchGradients::hiddenFeatures, hiddenBegin), pool.size(), hiddenEnd - hiddenBegin);
+
+    //-- Hidden Bias --//
+    if (threadId == 0) {
+        optimize(nn.hiddenBias.data(), nnGradients.hiddenBias, 0, slices(&BatchGradients::hiddenBias, 0), pool.size(), OUTPUT_SIZE);
+    }
+}
+
+// Scatter mode needs a full input gradient per thread, the hidden partition
+// shares the first thread's and feature-major mode needs none
+void Trainer::allocateInputGradients() {
+    for (std::size_t t = 0; t < batchGradients.size(); ++t) {
+        const bool scatter = partition == Partition::Hidden ? t == 0 : backwardMode == BackwardMode::Scatter;
+        batchGradients[t].setInputGradient(scatter);
+    }
+}
 
-        for (int j = 0; j < THREADS; ++j){
-            gradientSum += batchGradients[j].hiddenFeatures[i];
+// Hidden columns owned by threadId, split on cache line boundaries so
+// threads never write to the same line
+ThreadPool::Range Trainer::columnRange(const int threadId) const {
+    constexpr int LINE = 64 / sizeof(float);
+
+    const auto [begin, end] = pool.range(HIDDEN_SIZE / LINE, threadId);
+    return {begin * LINE, end * LINE};
+}
+
+// Forward and backward pass of the whole batch restricted to this thread's
+// hidden columns. Only the output needs the other threads: their partial
+// dot products are summed per sample in between.
+void Trainer::batchColumns(const int threadId) {
+    const Simd::Kernels&     simd = Simd::kernels();
+    const DataLoader::Batch& data = dataSetLoader.getBatch();
+
+    const auto [columnBegin, columnEnd] = columnRange(threadId);
+
+    const int columns = columnEnd - columnBegin;
+    const int size    = static_cast<int>(data.size);
+    float*    partial = partialOutputs.data() + static_cast<std::size_t>(threadId) * size;
+
+    const float* hiddenFeatures = nn.quantized() ? nn.hiddenQuantized.data() : nn.hiddenFeatures.data();
+
+    //--- Forward Pass ---//
+    for (int sample = 0; sample < size; ++sample) {
+        const std::int16_t* stmFeatures  = data.stmFeatures.data() + data.offsets[sample];
+        const std::int16_t* nstmFeatures = data.nstmFeatures.data() + data.offsets[sample];
+        const int           count        = data.featureCount(sample);
+
+        float* stmAccumulator  = activations.data() + static_cast<std::size_t>(sample) * HIDDEN_SIZE * 2 + columnBegin;
+        float* nstmAccumulator = stmAccumulator + HIDDEN_SIZE;
+
+        if (nn.quantized()) {
+            simd.accumulateInt16(stmAccumulator, nn.inputBiasQuantized.data() + columnBegin, nn.inputQuantized.data() + columnBegin, HIDDEN_SIZE, stmFeatures, 1, count, columns);
+            simd.accumulateInt16(nstmAccumulator, nn.inputBiasQuantized.data() + columnBegin, nn.inputQuantized.data() + columnBegin, HIDDEN_SIZE, nstmFeatures, 1, count, columns);
+
+            simd.clampScale(stmAccumulator, 0.0f, ACCUMULATOR_MAX, 1.0f / nn.quant.qa, columns);
+            simd.clampScale(nstmAccumulator, 0.0f, ACCUMULATOR_MAX, 1.0f / nn.quant.qa, columns);
+        } else {
+            if (nn.mixedPrecision()) {
+                simd.accumulateBf16(stmAccumulator, nn.inputBias.data() + columnBegin, nn.inputShadow.data() + columnBegin, HIDDEN_SIZE, stmFeatures, 1, count, columns);
+                simd.accumulateBf16(nstmAccumulator, nn.inputBias.data() + columnBegin, nn.inputShadow.data() + columnBegin, HIDDEN_SIZE, nstmFeatures, 1, count, columns);
+            } else {
+                simd.accumulate(stmAccumulator, nn.inputBias.data() + columnBegin, nn.inputFeatures.data() + columnBegin, HIDDEN_SIZE, stmFeatures, 1, count, columns);
+                simd.accumulate(nstmAccumulator, nn.inputBias.data() + columnBegin, nn.inputFeatures.data() + columnBegin, HIDDEN_SIZE, nstmFeatures, 1, count, columns);
+            }
+
+            simd.relu(stmAccumulator, columns);
+            simd.relu(nstmAccumulator, columns);
         }
 
-        adamUpdate(nn.hiddenFeatures[i], nnGradients.hiddenFeatures[i], gradientSum, learningRate);
+        partial[sample] = simd.dot(hiddenFeatures + columnBegin, stmAccumulator, columns)
+                        + simd.dot(hiddenFeatures + HIDDEN_SIZE + columnBegin, nstmAccumulator, columns);
     }
 
+    pool.barrier();
+
+    // Sum the partial outputs of this thread's share of the samples
+    const auto [begin, end] = pool.range(size, threadId);
+
+    losses[threadId] = 0;
+
+    for (int sample = begin; sample < end; ++sample) {
+        float output = nn.quantized() ? nn.hiddenBiasQuantized : nn.hiddenBias[0];
+        for (int t = 0; t < pool.size(); ++t) {
+            output += partialOutputs[static_cast<std::size_t>(t) * size + sample];
+        }
+
+        if (nn.quantized()) {
+            output = NN::truncateEval(output);
+        }
+
+        losses[threadId] += errorFunction(output, data.eval[sample], data.wdl[sample]);
+        outGradients[sample] = errorGradient(output, data.eval[sample], data.wdl[sample]) * sigmoidPrime(output);
+    }
+
+    pool.barrier();
+
+    //--- Backward Pass ---//
+    // Columns are disjoint, so all threads share one gradient buffer
+    BatchGradients& gradients = batchGradients[0];
+    BatchGradients& active    = batchGradients[threadId];
+
+    for (int sample = 0; sample < size; ++sample) {
+        const std::int16_t* stmFeatures  = data.stmFeatures.data() + data.offsets[sample];
+        const std::int16_t* nstmFeatures = data.nstmFeatures.data() + data.offsets[sample];
+        const int           count        = data.featureCount(sample);
+        const float         outGradient  = outGradients[sample];
+
+        const float* stmAccumulator  = activations.data() + static_cast<std::size_t>(sample) * HIDDEN_SIZE * 2 + columnBegin;
+        const float* nstmAccumulator = stmAccumulator + HIDDEN_SIZE;
+
+        // Hidden features
+        simd.axpy(gradients.hiddenFeatures.data() + columnBegin, outGradient, stmAccumulator, columns);
+        simd.axpy(gradients.hiddenFeatures.data() + HIDDEN_SIZE + columnBegin, outGradient, nstmAccumulator, columns);
+
+        std::array<float, HIDDEN_SIZE * 2> hiddenLosses;
+
+        simd.reluBackward(hiddenLosses.data(), outGradient, nn.hiddenFeatures.data() + columnBegin, stmAccumulator, columns);
+        simd.reluBackward(hiddenLosses.data() + columns, outGradient, nn.hiddenFeatures.data() + HIDDEN_SIZE + columnBegin, nstmAccumulator, columns);
+
+        // Input bias
+        simd.addRow(gradients.inputBias.data() + columnBegin, hiddenLosses.data(), columns);
+        simd.addRow(gradients.inputBias.data() + columnBegin, hiddenLosses.data() + columns, columns);
+
+        // Input features
+        for (int i = 0; i < count; ++i) {
+            active.markActive(stmFeatures[i]);
+            active.markActive(nstmFeatures[i]);
+        }
+
+        simd.scatter(gradients.inputFeatures.data() + columnBegin, HIDDEN_SIZE, stmFeatures, 1, count, hiddenLosses.data(), columns);
+        simd.scatter(gradients.inputFeatures.data() + columnBegin, HIDDEN_SIZE, nstmFeatures, 1, count, hiddenLosses.data() + columns, columns);
+    }
+}
+
+// Runs the optimizer on this thread's columns of every layer. Nothing has
+// to be reduced across threads, only the lazy Adam row steps are shared.
+void Trainer::applyColumnGradients(const int threadId) {
+    const std::uint64_t step = nnGradients.step;
+
+    const auto [columnBegin, columnEnd] = columnRange(threadId);
+
+    const int       columns   = columnEnd - columnBegin;
+    BatchGradients& gradients = batchGradients[0];
+    BatchGradients& active    = batchGradients[threadId];
+
+    // Updates and clears elements [offset, offset + n) of the shared gradient
+    auto update = [&](float* weights, Moments& moments, float* grads, const int offset, const int n) {
+        float* row = grads + offset;
+        optimize(weights, moments, offset, &row, 1, n);
+    };
+
+    // --- Input Features ---//
+    for (int feature = 0; feature < INPUT_SIZE; ++feature) {
+        // Rows without a gradient only need the optimizer in dense mode
+        if (!active.activeRows[feature] && (sparseInputGradients || lazyAdam)) {
+            continue;
+        }
+
+        const int offset = feature * HIDDEN_SIZE + columnBegin;
+
+        if (lazyAdam) {
+            catchUpRow(feature, columnBegin, columns, step - 1 - nnGradients.rowSteps[feature]);
+        }
+
+        update(nn.inputFeatures.data(), nnGradients.inputFeatures, gradients.inputFeatures.data(), offset, columns);
+        nn.refreshShadow(offset, columns);
+    }
+
+    // --- Input Bias ---//
+    update(nn.inputBias.data(), nnGradients.inputBias, gradients.inputBias.data(), columnBegin, columns);
+
+    // --- Hidden Features ---//
+    update(nn.hiddenFeatures.data(), nnGradients.hiddenFeatures, gradients.hiddenFeatures.data(), columnBegin, columns);
+    update(nn.hiddenFeatures.data(), nnGradients.hiddenFeatures, gradients.hiddenFeatures.data(), HIDDEN_SIZE + columnBegin, columns);
+
     //-- Hidden Bias --//
-    float gradientSum = 0;
-    for (int i = 0; i < THREADS; ++i){
-        gradientSum += batchGradients[i].hiddenBias[0];
+    if (threadId == 0) {
+        float gradientSum = 0;
+        for (std::size_t sample = 0; sample < dataSetLoader.getBatch().size; ++sample) {
+            gradientSum += outGradients[sample];
+        }
+        update(nn.hiddenBias.data(), nnGradients.hiddenBias, &gradientSum, 0, OUTPUT_SIZE);
+    }
+
+    // Every thread saw the same samples, so its active rows are the same set
+    if (lazyAdam) {
+        pool.barrier();
+
+        const auto [rowBegin, rowEnd] = pool.range(INPUT_SIZE, threadId);
+        for (int feature = rowBegin; feature < rowEnd; ++feature) {
+            if (active.activeRows[feature]) {
+                nnGradients.rowSteps[feature] = step;
+            }
+        }
     }
 
-    adamUpdate(nn.hiddenBias[0], nnGradients.hiddenBias[0], gradientSum, learningRate);
+    active.activeRows.fill(false);
 }
 
-void Trainer::train() {
-    std::ofstream lossFile(savePath + "/loss.csv", std::ios::app);
-    lossFile << "epoch,avg_epoch_error" << std::endl;
+void Trainer::step() {
+    nnGradients.step++;
 
-    for (int epoch = 1; epoch <= maxEpochs; ++epoch) {
-        std::uint64_t start           = getTimeMs();
-        std::size_t   batchIterations = 0;
-        double        epochError      = 0.0;
+    pool.run([this](const int threadId) {
+        if (partition == Partition::Hidden) {
+            batchColumns(threadId);
+            applyColumnGradients(threadId);
+            return;
+        }
 
-        const std::size_t batchSize = dataSetLoader.batchSize;
+        // Forward and backward pass over this thread's share of the batch
+        batch(threadId);
+
+        pool.barrier();
+
+        if (backwardMode == BackwardMode::FeatureMajor) {
+            bucketFeatures(threadId);
+        }
+
+        // Gradient descent
+        applyGradients(threadId);
+    });
+
+    nn.refreshQuantizedDense();
+}
+
+void Trainer::flushLazyRows() {
+    if (!lazyAdam) {
+        return;
+    }
+
+    const std::uint64_t step = nnGradients.step;
 
-        for (int b = 0; b < EPOCH_SIZE / batchSize; ++b) {
-            batchIterations++;
-            double batchError = 0;
+    pool.run([this, step](const int threadId) {
+        const auto [rowBegin, rowEnd] = pool.range(INPUT_SIZE, threadId);
 
-            // Clear gradients and losses
-            clearGradientsAndLosses();
+        for (int feature = rowBegin; feature < rowEnd; ++feature) {
+            catchUpRow(feature, 0, HIDDEN_SIZE, step - nnGradients.rowSteps[feature]);
+            nnGradients.rowSteps[feature] = step;
+            nn.refreshShadow(feature * HIDDEN_SIZE, HIDDEN_SIZE);
+        }
+    });
+}
+
+// Forward and backward pass over one batch, applying the accumulated
+// gradients every HOGWILD_MICRO_BATCH samples. Other workers read and
+// write the same weights meanwhile. Returns the summed loss.
+double Trainer::hogwildBatch(const int threadId, const DataLoader::Batch& data) {
+    const Simd::Kernels& simd      = Simd::kernels();
+    SparseGradients&     gradients = sparseGradients[threadId];
+
+    double loss = 0;
+
+    for (std::size_t begin = 0; begin < data.size; begin += HOGWILD_MICRO_BATCH) {
+        const std::size_t end = std::min(data.size, begin + HOGWILD_MICRO_BATCH);
+
+        for (std::size_t sample = begin; sample < end; ++sample) {
+            const std::int16_t* stmFeatures  = data.stmFeatures.data() + data.offsets[sample];
+            const std::int16_t* nstmFeatures = data.nstmFeatures.data() + data.offsets[sample];
+            const int           count        = data.featureCount(sample);
+
+            NN::Accumulator accumulator;
+
+            const auto eval = data.eval[sample];
+            const auto wdl  = data.wdl[sample];
+
+            //--- Forward Pass ---//
+            const float output = nn.forward(accumulator, stmFeatures, nstmFeatures, count);
 
-            // Perform batch operations
-            batch();
+            loss += errorFunction(output, eval, wdl);
 
-            // Calculate batch error
-            for (int threadId = 0; threadId < THREADS; ++threadId) {
-                batchError += static_cast<double>(losses[threadId]);
+            //--- Backward Pass ---//
+            const float outGradient = errorGradient(output, eval, wdl) * sigmoidPrime(output);
+
+            gradients.hiddenBias[0] += outGradient;
+            simd.axpy(gradients.hiddenFeatures.data(), outGradient, accumulator.data(), HIDDEN_SIZE * 2);
+
+            std::array<float, HIDDEN_SIZE * 2> hiddenLosses;
+
+            simd.reluBackward(hiddenLosses.data(), outGradient, nn.hiddenFeatures.data(), accumulator.data(), HIDDEN_SIZE * 2);
+
+            simd.addRow(gradients.inputBias.data(), hiddenLosses.data(), HIDDEN_SIZE);
+            simd.addRow(gradients.inputBias.data(), hiddenLosses.data() + HIDDEN_SIZE, HIDDEN_SIZE);
+
+            // Input features go to their compact slots
+            std::array<std::int16_t, DataLoader::MAX_FEATURES> stmSlots;
+            std::array<std::int16_t, DataLoader::MAX_FEATURES> nstmSlots;
+
+            for (int i = 0; i < count; ++i) {
+                stmSlots[i]  = gradients.slot(stmFeatures[i]);
+                nstmSlots[i] = gradients.slot(nstmFeatures[i]);
             }
 
-            // Accumulate epoch error
-            epochError += batchError;
+            simd.scatter(gradients.inputFeatures.data(), HIDDEN_SIZE, stmSlots.data(), 1, count, hiddenLosses.data(), HIDDEN_SIZE);
+            simd.scatter(gradients.inputFeatures.data(), HIDDEN_SIZE, nstmSlots.data(), 1, count, hiddenLosses.data() + HIDDEN_SIZE, HIDDEN_SIZE);
+        }
+
+        hogwildApply(gradients);
+    }
+
+    return loss;
+}
+
+// Optimizer step straight on the shared weights. Rows are not locked, the busy flag
+// only counts how often two workers updated the same row at once.
+void Trainer::hogwildApply(SparseGradients& gradients) {
+    // --- Input Features ---//
+    for (std::size_t slot = 0; slot < gradients.rows.size(); ++slot) {
+        const int feature = gradients.rows[slot];
+
+        if (rowBusy[feature].exchange(true, std::memory_order_acquire)) {
+            rowCollisions.fetch_add(1, std::memory_order_relaxed);
+        }
+
+        float* row = gradients.inputFeatures.data() + slot * HIDDEN_SIZE;
+        optimize(nn.inputFeatures.data(), nnGradients.inputFeatures, feature * HIDDEN_SIZE, &row, 1, HIDDEN_SIZE);
+        nn.refreshShadow(feature * HIDDEN_SIZE, HIDDEN_SIZE);
+
+        rowBusy[feature].store(false, std::memory_order_release);
+    }
+
+    rowUpdates.fetch_add(gradients.rows.size(), std::memory_order_relaxed);
+
+    // Every sample touches the dense layers, so their updates are serialized.
+    // A worker that finds them taken leaves its gradients to the owner.
+    std::unique_lock<std::mutex> owner(denseMutex, std::try_to_lock);
+
+    {
+        std::lock_guard<std::mutex> lock(pendingMutex);
+
+        if (owner.owns_lock()) {
+            Simd::kernels().addRow(gradients.inputBias.data(), pendingInputBias.data(), HIDDEN_SIZE);
+            Simd::kernels().addRow(gradients.hiddenFeatures.data(), pendingHiddenFeatures.data(), HIDDEN_SIZE * 2);
+            Simd::kernels().addRow(gradients.hiddenBias.data(), pendingHiddenBias.data(), OUTPUT_SIZE);
+            pendingInputBias.fill(0);
+            pendingHiddenFeatures.fill(0);
+            pendingHiddenBias.fill(0);
+        } else {
+            Simd::kernels().addRow(pendingInputBias.data(), gradients.inputBias.data(), HIDDEN_SIZE);
+            Simd::kernels().addRow(pendingHiddenFeatures.data(), gradients.hiddenFeatures.data(), HIDDEN_SIZE * 2);
+            Simd::kernels().addRow(pendingHiddenBias.data(), gradients.hiddenBias.data(), OUTPUT_SIZE);
+        }
+    }
+
+    if (owner.owns_lock()) {
+        hogwildApplyDense(gradients.inputBias.data(), gradients.hiddenFeatures.data(), gradients.hiddenBias.data());
+    }
+
+    // The kernels already zeroed the applied gradients, this resets the slots and the rest
+    gradients.clear();
+}
 
-            // Gradient descent
-            applyGradients();
+// Only called by the owner of denseMutex, or once the workers are done
+void Trainer::hogwildApplyDense(float* inputBias, float* hiddenFeatures, float* hiddenBias) {
+    optimize(nn.inputBias.data(), nnGradients.inputBias, 0, &inputBias, 1, HIDDEN_SIZE);
+    optimize(nn.hiddenFeatures.data(), nnGradients.hiddenFeatures, 0, &hiddenFeatures, 1, HIDDEN_SIZE * 2);
+    optimize(nn.hiddenBias.data(), nnGradients.hiddenBias, 0, &hiddenBias, 1, OUTPUT_SIZE);
+    nn.refreshQuantizedDense();
+}
 
-            // Load the next batch
-            dataSetLoader.loadNextBatch();
+// One epoch with every worker taking batches from the loader on its own
+double Trainer::hogwildEpoch(const int epoch, const std::size_t batches, const std::uint64_t start) {
+    std::atomic<std::size_t> next{0};
+    std::atomic<std::size_t> done{0};
+    std::atomic<double>      epochError{0.0};
+    std::size_t              nextPrint = 0; // thread 0 only
+
+    rowUpdates    = 0;
+    rowCollisions = 0;
+
+    pool.run([&](const int threadId) {
+        for (std::size_t index; (index = next.fetch_add(1)) < batches;) {
+            double batchError;
+
+            // The loader's current batch is trained first and then replaced,
+            // so it always holds a real batch for exportQuantized to check
+            if (index == 0) {
+                batchError = hogwildBatch(threadId, dataSetLoader.getBatch());
+                dataSetLoader.loadNextBatch();
+            } else {
+                DataLoader::Batch* data = dataSetLoader.acquireBatch();
+                if (data == nullptr) {
+                    break;
+                }
+
+                batchError = hogwildBatch(threadId, *data);
+                dataSetLoader.releaseBatch(data);
+            }
+
+            epochError += batchError;
+            const std::size_t b = done.fetch_add(1);
 
-            // Print progress
-            if (b % 100 == 0 || b == EPOCH_SIZE / batchSize - 1) {
+            // Print progress every 100 batches, from one thread so the lines don't interleave
+            if (threadId == 0 && (b >= nextPrint || b == batches - 1)) {
+                nextPrint                    = b - b % 100 + 100;
                 std::uint64_t end            = getTimeMs();
-                int           positionsCount = (b + 1) * batchSize;
+                std::size_t   positionsCount = (b + 1) * dataSetLoader.batchSize;
                 int           posPerSec      = static_cast<int>(positionsCount / ((end - start) / 1000.0));
-                printf("\rep/ba:[%4d/%4d] |batch error:[%1.9f]|epoch error:[%1.9f]|speed:[%9d] pos/s", epoch, b, batchError / static_cast<double>(dataSetLoader.batchSize), EPOCH_ERROR, posPerSec);
+                printf("\rep/ba:[%4d/%4zu] |batch error:[%1.9f]|epoch error:[%1.9f]|speed:[%9d] pos/s", epoch, b, batchError / static_cast<double>(dataSetLoader.batchSize), epochError / static_cast<double>(positionsCount), posPerSec);
                 std::cout << std::flush;
             }
         }
+    });
+
+    std::cout << std::endl;
+
+    // Gradients the last owner didn't pick up anymore
+    hogwildApplyDense(pendingInputBias.data(), pendingHiddenFeatures.data(), pendingHiddenBias.data());
+
+    const std::uint64_t updates = rowUpdates;
+    printf("hogwild: row updates [%llu] | collisions [%llu] (%.3f%%) | time [%.1f s]\n", static_cast<unsigned long long>(updates), static_cast<unsigned long long>(rowCollisions.load()),
+           100.0 * rowCollisions / std::max<std::uint64_t>(1, updates), (getTimeMs() - start) / 1000.0);
+
+    return epochError;
+}
+
+void Trainer::saveCheckpoint(const std::string& _checkpointPath, const std::string& _exportPath) {
+    flushLazyRows();
+
+    const std::vector<DataLoader::Cursor> cursors = dataSetLoader.cursors();
+    const DataLoader::StreamCursor        stream  = dataSetLoader.streamCursor();
+
+    const Checkpoint::TrainingState state{
+        learningRate,
+        static_cast<std::uint32_t>(completedEpochs),
+        batchesTrained,
+        nnGradients.step,
+        cursors.empty() ? 0 : cursors[0].chunk,
+        static_cast<std::uint32_t>(optimizer),
+        static_cast<std::uint32_t>(nnGradients.inputFeatures.storage),
+    };
+
+    Checkpoint::Builder builder;
+    builder.add(Checkpoint::SectionId::InputFeatures, nn.inputFeatures.data(), sizeof(nn.inputFeatures));
+    builder.add(Checkpoint::SectionId::InputBias, nn.inputBias.data(), sizeof(nn.inputBias));
+    builder.add(Checkpoint::SectionId::HiddenFeatures, nn.hiddenFeatures.data(), sizeof(nn.hiddenFeatures));
+    builder.add(Checkpoint::SectionId::HiddenBias, nn.hiddenBias.data(), sizeof(nn.hiddenBias));
+    builder.add(Checkpoint::SectionId::TrainingState, &state, sizeof(state));
+    builder.add(Checkpoint::SectionId::DatasetCursor, cursors.data(), cursors.size() * sizeof(DataLoader::Cursor));
+    builder.add(Checkpoint::SectionId::DatasetStream, &stream, sizeof(stream));
+
+    if (saveOptimizerState) {
+        builder.add(Checkpoint::SectionId::RowSteps, nnGradients.rowSteps.data(), sizeof(nnGradients.rowSteps));
+
+        std::uint32_t index = 0;
+        for (Moments* moments : nnGradients.layers()) {
+            builder.add(Checkpoint::SectionId::Moments, moments->M.data(), moments->M.size(), index++);
+            builder.add(Checkpoint::SectionId::Moments, moments->V.data(), moments->V.size(), index++);
+        }
+    }
+
+    std::vector<FileSnapshot> files{{_checkpointPath, nn.sections(), {}, {}}, builder.snapshot(statePath(_checkpointPath))};
+
+    // The export snapshot reuses buffers the previous job may still read
+    checkpointWriter.wait();
+    std::function<void()> exportJob = _exportPath.empty() ? nullptr : exportQuantized(_exportPath, files);
+
+    checkpointWriter.write(files, pool, std::move(exportJob));
+
+    if (!asyncSave) {
+        checkpointWriter.wait();
+    }
+}
+
+void Trainer::loadCheckpoint(const std::string& _checkpointPath) {
+    const bool isState = std::filesystem::path(_checkpointPath).extension() == ".ckpt";
+
+    if (isState || std::filesystem::exists(statePath(_checkpointPath))) {
+        if (loadState(statePath(_checkpointPath)) || isState) {
+            return;
+        }
+    }
+
+    nn.load(_checkpointPath);
+}
+
+bool Trainer::loadState(const std::string& _statePath) {
+    Checkpoint::Reader reader;
+
+    if (!reader.open(_statePath)) {
+        return false;
+    }
+
+    const auto copy = [&reader](const Checkpoint::SectionId id, void* dst, const std::size_t size, const std::uint32_t index = 0) {
+        const auto section = reader.section(id, index);
+        if (section.size() != size) {
+            return false;
+        }
+
+        std::memcpy(dst, section.data(), size);
+        return true;
+    };
+
+    Checkpoint::TrainingState state;
+    DataLoader::StreamCursor  stream;
+
+    const auto cursorSection = reader.section(Checkpoint::SectionId::DatasetCursor);
+
+    if (!copy(Checkpoint::SectionId::InputFeatures, nn.inputFeatures.data(), sizeof(nn.inputFeatures))
+        || !copy(Checkpoint::SectionId::InputBias, nn.inputBias.data(), sizeof(nn.inputBias))
+        || !copy(Checkpoint::SectionId::HiddenFeatures, nn.hiddenFeatures.data(), sizeof(nn.hiddenFeatures))
+        || !copy(Checkpoint::SectionId::HiddenBias, nn.hiddenBias.data(), sizeof(nn.hiddenBias))
+        || !copy(Checkpoint::SectionId::TrainingState, &state, sizeof(state))
+        || !copy(Checkpoint::SectionId::DatasetStream, &stream, sizeof(stream))
+        || cursorSection.empty() || cursorSection.size() % sizeof(DataLoader::Cursor) != 0) {
+        std::cout << "Couldn't read checkpoint " << _statePath << ", sections are missing or have the wrong size" << std::endl;
+        return false;
+    }
+
+    nn.refreshShadows();
+
+    learningRate    = state.learningRate;
+    completedEpochs = static_cast<int>(state.epoch);
+    batchesTrained  = state.batches;
+
+    std::vector<DataLoader::Cursor> cursors(cursorSection.size() / sizeof(DataLoader::Cursor));
+    std::memcpy(cursors.data(), cursorSection.data(), cursorSection.size());
+
+    if (stream.seed != dataSetLoader.seed || stream.window * CHUNK_SIZE != dataSetLoader.reservoirSize) {
+        std::cout << "Resuming the shuffle with the checkpoint's seed " << stream.seed << " and a buffer of " << stream.window * CHUNK_SIZE << " positions" << std::endl;
+    }
+
+    if (dataSetLoader.startPosition > 0) {
+        std::cout << "Ignoring --dataset-skip " << dataSetLoader.startPosition << ", resuming at the checkpoint's dataset position" << std::endl;
+    }
+
+    dataSetLoader.setCursors(cursors, stream);
+
+    nnGradients.clear();
+    nnGradients.step = state.step;
+
+    const MomentStorage storage     = static_cast<MomentStorage>(state.momentStorage);
+    const std::size_t   elementSize = storage == MomentStorage::FP32 ? sizeof(float) : sizeof(std::uint16_t);
+
+    bool restored = state.optimizer == static_cast<std::uint32_t>(optimizer) && state.momentStorage < MOMENT_STORAGE_COUNT
+                    && copy(Checkpoint::SectionId::RowSteps, nnGradients.rowSteps.data(), sizeof(nnGradients.rowSteps));
+
+    std::uint32_t index = 0;
+    for (Moments* moments : nnGradients.layers()) {
+        const auto m = reader.section(Checkpoint::SectionId::Moments, index++);
+        const auto v = reader.section(Checkpoint::SectionId::Moments, index++);
+
+        restored = restored && m.size() == moments->size * elementSize && v.size() == moments->size * elementSize;
+        if (restored) {
+            moments->assign(storage, reinterpret_cast<const std::byte*>(m.data()), reinterpret_cast<const std::byte*>(v.data()));
+        }
+    }
+
+    if (!restored) {
+        std::cout << "Checkpoint " << _statePath << " has no matching optimizer state, starting the moments over" << std::endl;
+
+        // Nothing for lazy rows to catch up on
+        nnGradients.clear();
+        nnGradients.step = state.step;
+        nnGradients.rowSteps.fill(state.step);
+    }
+
+    std::cout << "Resuming " << _statePath << " after epoch " << completedEpochs << " (" << batchesTrained << " batches, lr " << learningRate << ")" << std::endl;
+    return true;
+}
+
+std::function<void()> Trainer::exportQuantized(const std::string& _path, std::vector<FileSnapshot>& files) {
+    if (exportNet == nullptr) {
+        exportNet = std::make_unique<NN>();
+        exportNet->setMixedPrecision(nn.mixedPrecision());
+        exportNet->setQuantization(nn.quantized(), nn.quant);
+    }
+
+    // The weights file is copied straight into the export net, in NN::sections() order
+    files[0].targets = {exportNet->inputFeatures.data(), exportNet->inputBias.data(), exportNet->hiddenFeatures.data(), exportNet->hiddenBias.data()};
+
+    const std::size_t positions = std::min<std::size_t>(std::max(0, verifyPositions), dataSetLoader.getBatch().size);
+    if (exportBatch.offsets.size() < positions + 1) {
+        exportBatch.allocate(positions);
+    }
+    files.push_back(dataSetLoader.getBatch().snapshot(exportBatch, positions));
+
+    return [this, _path, scheme = nn.quant, interleave = exportInterleave, positions]() {
+        exportNet->refreshShadows();
+
+        const QuantizedNN quantized(*exportNet, scheme);
+
+        if (!quantized.save(_path, interleave) || positions == 0) {
+            return;
+        }
+
+        const QuantError error = verifyQuantized(*exportNet, quantized, exportBatch, static_cast<int>(positions));
+        printf("quantized: %s | positions [%d] | max error [%7.2f cp] | mean error [%7.3f cp]\n", _path.c_str(), error.positions, error.maxError, error.meanError);
+    };
+}
+
+void Trainer::train() {
+    if (!dataSetLoader.init()) {
+        return;
+    }
+
+    std::ofstream lossFile(savePath + "/loss.csv", std::ios::app);
+    lossFile << "epoch,avg_epoch_error" << std::endl;
+
+    for (int epoch = completedEpochs + 1; epoch <= maxEpochs; ++epoch) {
+        std::uint64_t start           = getTimeMs();
+        std::size_t   batchIterations = 0;
+        double        epochError      = 0.0;
+
+        const std::size_t batchSize = dataSetLoader.batchSize;
+        const std::size_t batches   = std::max<std::size_t>(1, epochSize / batchSize);
+
+        if (hogwild) {
+            epochError      = hogwildEpoch(epoch, batches, start);
+            batchIterations = batches;
+        } else {
+            for (std::size_t b = 0; b < batches; ++b) {
+                batchIterations++;
+                double batchError = 0;
+
+                // Forward, backward and gradient descent
+                step();
+
+                // Calculate batch error
+                for (int threadId = 0; threadId < pool.size(); ++threadId) {
+                    batchError += static_cast<double>(losses[threadId]);
+                }
+
+                // Accumulate epoch error
+                epochError += batchError;
+
+                // Load the next batch
+                dataSetLoader.loadNextBatch();
+                if (dataSetLoader.hasFailed()) {
+                    break;
+                }
+
+                // Print progress
+                if (b % 100 == 0 || b == batches - 1) {
+                    std::uint64_t end            = getTimeMs();
+                    std::size_t   positionsCount = (b + 1) * batchSize;
+                    int           posPerSec      = static_cast<int>(positionsCount / ((end - start) / 1000.0));
+                    printf("\rep/ba:[%4d/%4zu] |batch error:[%1.9f]|epoch error:[%1.9f]|speed:[%9d] pos/s", epoch, b, batchError / static_cast<double>(dataSetLoader.batchSize), EPOCH_ERROR, posPerSec);
+                    std::cout << std::flush;
+                }
+            }
+
+            std::cout << std::endl;
+        }
+
+        // The epoch is incomplete, keep the last saved state
+        if (dataSetLoader.hasFailed()) {
+            std::cout << "Stopping in epoch " << epoch << ", the dataset can't be read" << std::endl;
+            break;
+        }
+
+        // Bring skipped rows up to date before saving or changing the learning rate
+        flushLazyRows();
+
+        completedEpochs = epoch;
+        batchesTrained += batchIterations;
 
-        std::cout << std::endl;
         printf("epoch: [%5d/%5d] | avg_epoch_error: [%11.9f]\n", epoch, maxEpochs, EPOCH_ERROR);
 
-        // Save the network
-        if (epoch % saveInterval == 0) {
-            save(std::to_string(epoch));
+        const auto loaderStats = dataSetLoader.stats();
+        printf("loader: avg queue depth [%5.2f/%zu] | trainer stalled [%6llu ms] | producers stalled [%6llu ms]\n", loaderStats.averageQueueDepth, DataLoader::BATCH_QUEUE_DEPTH,
+               static_cast<unsigned long long>(loaderStats.trainerStallMs), static_cast<unsigned long long>(loaderStats.producerStallMs));
+
+        // Only the chunks decoded during the epoch, which can be none while a big one lasts
+        const DataLoader::FilterStats filterStats = dataSetLoader.filterStats();
+        if (filterStats.seen > 0) {
+            std::uint64_t kept = filterStats.seen;
+            for (const std::uint64_t rejected : filterStats.rejected) {
+                kept -= rejected;
+            }
+
+            printf("filters: kept [%5.1f%%]", 100.0 * kept / filterStats.seen);
+            for (std::size_t i = 0; i < DataLoader::FILTER_COUNT; ++i) {
+                if (filterStats.rejected[i] > 0) {
+                    printf(" | %s [%5.1f%%]", DataLoader::filterName(static_cast<DataLoader::Filter>(i)), 100.0 * filterStats.rejected[i] / filterStats.seen);
+                }
+            }
+            printf("\n");
         }
 
+        // Decay first, so a checkpoint taken on this epoch resumes at the rate the next epoch uses
         if (epoch % lrDecayInterval == 0) {
             std::cout << "Decaying learning rate" << std::endl;
             learningRate *= lrDecay;
         }
 
-        if (epoch % 100 == 0) {
-            dataSetLoader.shuffle();
+        // Save the network
+        if (epoch % saveInterval == 0) {
+            save(std::to_string(epoch));
         }
 
         lossFile << epoch << "," << EPOCH_ERROR << std::endl;
     }
-}
 
-void Trainer::clearGradientsAndLosses() {
-    for (auto& grad : batchGradients) {
-        grad.clear();
-    }
-    memset(losses.data(), 0, sizeof(float) * THREADS);
-}
\ No newline at end of file
+    checkpointWriter.wait();
+}
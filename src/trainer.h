@@ -1,14 +1,42 @@
 #pragma once
 
+#include "alignedbuffer.h"
+#include "checkpointwriter.h"
 #include "dataloader.h"
 #include "gradient.h"
+#include "optimizer.h"
+#include "quantize.h"
+#include "threadpool.h"
 #include "types.h"
+#include <atomic>
 #include <filesystem>
+#include <functional>
+#include <memory>
+#include <mutex>
 #include <vector>
 
+// How the input layer gradient is built from a batch
+enum class BackwardMode {
+    // Every sample adds its hidden losses to a per-thread copy of the gradient
+    Scatter,
+    // (feature, sample) pairs are bucketed by feature and every row sums its samples once
+    FeatureMajor,
+};
+
+// Samples per Hogwild update
+constexpr int HOGWILD_MICRO_BATCH = 256;
+
+// How the work of a batch is split between the threads
+enum class Partition {
+    // Every thread runs whole samples and keeps its own gradient copy
+    Samples,
+    // Every thread owns a slice of the hidden columns for the whole batch
+    Hidden,
+};
+
 class Trainer {
 private:
-    std::size_t epochSize = 1e7;
+    std::size_t epochSize = 1e9;
     std::string path;
 
     std::string savePath;
@@ -16,32 +44,126 @@ private:
     int         maxEpochs    = 0;
     float       learningRate = 0.01;
 
+    Optimizer optimizer   = Optimizer::Adam;
+    float     weightDecay = 0.01f;
+
+    // Seeds the stochastic rounding of 16 bit optimizer moments
+    std::atomic<std::uint32_t> roundingSeed{0x12345678u};
+
     int lrDecayInterval = 100;
     float lrDecay     = 0.5;
     int saveInterval = 1;
+
+    // Only hand input rows that received a gradient this batch to the optimizer
+    bool sparseInputGradients = false;
+
+    // Training progress, restored from a checkpoint
+    int           completedEpochs = 0;
+    std::uint64_t batchesTrained  = 0;
+
+    // Owned by the writer thread while an export job is pending, declared
+    // first so they outlive it
+    std::unique_ptr<NN> exportNet;
+    DataLoader::Batch   exportBatch;
+
+    // Checkpoints are written by a background thread unless asyncSave is off
+    CheckpointWriter checkpointWriter;
+    bool             asyncSave          = true;
+    bool             saveOptimizerState = true;
+
+    // Quantized export: AVX2 column order and positions checked against the float net
+    bool exportInterleave = false;
+    int  verifyPositions  = 1024;
+
+    // Lazy Adam: skipped rows catch up on their zero-gradient steps when next touched
+    bool lazyAdam = false;
+
+    BackwardMode backwardMode = BackwardMode::Scatter;
+
+    // Feature-major backward: hidden losses of every sample (stm half first),
+    // per-thread feature counts, bucket starts and the bucketed
+    // (sample << 1 | perspective) pairs
+    AlignedBuffer<float>                     sampleLosses;
+    std::vector<std::array<int, INPUT_SIZE>> featureCounts;
+    std::array<int, INPUT_SIZE + 1>          bucketStart;
+    AlignedBuffer<std::uint32_t>             featureSamples;
+
+    Partition partition = Partition::Samples;
+
+    // Hidden partitioning: post-ReLU accumulators of every sample, each
+    // thread's share of every output and the output gradients
+    AlignedBuffer<float> activations;
+    AlignedBuffer<float> partialOutputs;
+    AlignedBuffer<float> outGradients;
+
+    // Hogwild: workers take batches on their own and update the weights
+    // directly every HOGWILD_MICRO_BATCH samples, without any barrier
+    bool                                      hogwild = false;
+    std::vector<SparseGradients>              sparseGradients;
+    std::array<std::atomic<bool>, INPUT_SIZE> rowBusy{};
+    std::atomic<std::uint64_t>                rowUpdates{0};
+    std::atomic<std::uint64_t>                rowCollisions{0};
+
+    // Dense layers have one owner at a time, the others add their
+    // gradients to the pending ones for the next owner to apply
+    std::mutex                         denseMutex;
+    std::mutex                         pendingMutex;
+    std::array<float, HIDDEN_SIZE>     pendingInputBias{};
+    std::array<float, HIDDEN_SIZE * 2> pendingHiddenFeatures{};
+    std::array<float, OUTPUT_SIZE>     pendingHiddenBias{};
+
+    double hogwildEpoch(const int epoch, const std::size_t batches, const std::uint64_t start);
+    double hogwildBatch(const int threadId, const DataLoader::Batch& data);
+    void   hogwildApply(SparseGradients& gradients);
+    void   hogwildApplyDense(float* inputBias, float* hiddenFeatures, float* hiddenBias);
+
+    OptimizerParams optimizerParams() const {
+        return {learningRate, BETA1, BETA2, EPSILON, weightDecay};
+    }
+
+    void optimize(float* weights, Moments& moments, const std::size_t offset, float* const* grads, const int count, const int n);
+    void catchUpRow(const int feature, const int column, const int n, const std::uint64_t skipped);
+
+    void bucketFeatures(const int threadId);
+    bool gatherRow(const int feature, float* gradientSum);
+    ThreadPool::Range rowRange(const int threadId) const;
+    ThreadPool::Range columnRange(const int threadId) const;
+    void allocateInputGradients();
 public:
     DataLoader::DataSetLoader   dataSetLoader;
     NN                          nn;
     NNGradients                 nnGradients;
     std::vector<BatchGradients> batchGradients;
     std::vector<float>          losses;
+    ThreadPool                  pool;
 
-    Trainer(const std::string& _path, const std::size_t _batchSize) : dataSetLoader{_path, _batchSize}, path(_path) {
-        batchGradients.resize(THREADS);
-        losses.resize(THREADS);
+    Trainer(const std::string& _path, const std::size_t _batchSize, const int _threads) : path(_path), dataSetLoader{_path, _batchSize}, pool(_threads) {
+        batchGradients.resize(_threads);
+        losses.resize(_threads);
         nnGradients.clear();
+        allocateInputGradients();
     }
 
-    void clearGradientsAndLosses();
     void train();
-    void batch();
-    void loadFeatures(DataLoader::DataSetEntry& entry, Features& features);
-    void applyGradients();
+    void step();
+    void batch(const int threadId);
+    void applyGradients(const int threadId);
+    void batchColumns(const int threadId);
+    void applyColumnGradients(const int threadId);
+    void flushLazyRows();
 
     std::size_t getBatchSize() const {
         return dataSetLoader.batchSize;
     }
 
+    std::size_t getEpochSize() const {
+        return epochSize;
+    }
+
+    int getThreads() const {
+        return pool.size();
+    }
+
     void setNetworkId(const std::string& _networkId) {
         if (_networkId.empty()) {
             std::string randomHexValue = generateRandomHexValue(4);
@@ -63,13 +185,54 @@ public:
     }
 
     void save(const std::string& epoch = "") {
-        nn.save(savePath + "/checkpoints/" + networkId + "_ep" + epoch + ".nn");
+        saveCheckpoint(savePath + "/checkpoints/" + networkId + "_ep" + epoch + ".nn", savePath + "/quantized/" + networkId + "_ep" + epoch + ".bin");
     }
 
+    // Has the checkpoint writer copy the weights, files[0], and a few
+    // samples of the current batch into the export net and batch. The
+    // returned job writes the engine's integer network from them and checks
+    // it against the float forward pass, on the checkpoint writer's thread.
+    std::function<void()> exportQuantized(const std::string& _path, std::vector<FileSnapshot>& files);
+
     void setMaxEpochs(const int _maxEpochs) {
         maxEpochs = _maxEpochs;
     }
-    void setEpochSize(const int _epochSize) {
+    void setDecoderThreads(const int _decoderThreads) {
+        dataSetLoader.setDecoderThreads(_decoderThreads);
+    }
+
+    void setProducerThreads(const int _producerThreads) {
+        dataSetLoader.setProducerThreads(_producerThreads);
+    }
+
+    void setMmap(const bool _useMmap) {
+        dataSetLoader.setMmap(_useMmap);
+    }
+
+    // Pins the training workers, see ThreadPool::pin
+    void setPinThreads(const bool _pinThreads) {
+        if (_pinThreads) {
+            pool.pin();
+        }
+    }
+
+    void setShuffleBuffer(const std::size_t _positions) {
+        dataSetLoader.setShuffleBuffer(_positions);
+    }
+
+    void setShuffleSeed(const std::uint64_t _seed) {
+        dataSetLoader.setSeed(_seed);
+    }
+
+    void setFilters(const DataLoader::FilterChain& _filters) {
+        dataSetLoader.setFilters(_filters);
+    }
+
+    void setDatasetSkip(const std::uint64_t _positions) {
+        dataSetLoader.skipPositions(_positions);
+    }
+
+    void setEpochSize(const std::size_t _epochSize) {
         epochSize = _epochSize;
     }
 
@@ -80,11 +243,26 @@ public:
         return savePath;
     }
 
-    void loadCheckpoint(const std::string& _checkpointPath) {
-        nn.load(_checkpointPath);
+    // The full training state is kept next to the weights as <name>.ckpt
+    static std::string statePath(const std::string& _checkpointPath) {
+        return std::filesystem::path(_checkpointPath).replace_extension(".ckpt").string();
+    }
+
+    // Takes a .ckpt, or a .nn which resumes from the .ckpt next to it if
+    // there is one and otherwise only restores the weights (and a .opt)
+    void loadCheckpoint(const std::string& _checkpointPath);
+    bool loadState(const std::string& _statePath);
+
+    // Snapshots the weights and the training state and returns, the files
+    // and the quantized export, if a path is given, are written in the background
+    void saveCheckpoint(const std::string& _checkpointPath, const std::string& _exportPath = "");
+
+    void setAsyncSave(const bool _asyncSave) {
+        asyncSave = _asyncSave;
     }
-    void saveCheckpoint(const std::string& _checkpointPath) {
-        nn.save(_checkpointPath);
+
+    void setSaveOptimizerState(const bool _saveOptimizerState) {
+        saveOptimizerState = _saveOptimizerState;
     }
 
     void setLearningRate(const float _learningRate) {
@@ -98,4 +276,106 @@ public:
     void setSaveInterval(const int _saveInterval) {
         saveInterval = _saveInterval;
     }
+
+    void setSparseInputGradients(const bool _sparseInputGradients) {
+        sparseInputGradients = _sparseInputGradients;
+    }
+
+    void setOptimizer(const Optimizer _optimizer) {
+        optimizer = _optimizer;
+    }
+
+    Optimizer getOptimizer() const {
+        return optimizer;
+    }
+
+    void setMomentStorage(const MomentStorage _storage) {
+        nnGradients.setStorage(_storage);
+    }
+
+    MomentStorage getMomentStorage() const {
+        return nnGradients.inputFeatures.storage;
+    }
+
+    void setWeightDecay(const float _weightDecay) {
+        weightDecay = _weightDecay;
+    }
+
+    void setLazyAdam(const bool _lazyAdam) {
+        lazyAdam = _lazyAdam;
+    }
+
+    void setBackwardMode(const BackwardMode _backwardMode) {
+        backwardMode = _backwardMode;
+
+        if (backwardMode == BackwardMode::FeatureMajor) {
+            const std::size_t batchSize = dataSetLoader.batchSize;
+
+            sampleLosses.resize(batchSize * HIDDEN_SIZE * 2);
+            featureCounts.resize(pool.size());
+            featureSamples.resize(batchSize * DataLoader::MAX_FEATURES * 2);
+        }
+
+        allocateInputGradients();
+    }
+
+    void setPartition(const Partition _partition) {
+        partition = _partition;
+
+        if (partition == Partition::Hidden) {
+            const std::size_t batchSize = dataSetLoader.batchSize;
+
+            activations.resize(batchSize * HIDDEN_SIZE * 2);
+            partialOutputs.resize(batchSize * pool.size());
+            outGradients.resize(batchSize);
+        }
+
+        allocateInputGradients();
+    }
+
+    // Forward pass reads a bf16 shadow of the input weights
+    void setMixedPrecision(const bool _mixedPrecision) {
+        nn.setMixedPrecision(_mixedPrecision);
+    }
+
+    bool getMixedPrecision() const {
+        return nn.mixedPrecision();
+    }
+
+    // Forward pass simulates the engine's fixed point network
+    void setQuantization(const bool _enabled, const QuantScheme& _scheme) {
+        nn.setQuantization(_enabled, _scheme);
+    }
+
+    bool getQuantization() const {
+        return nn.quantized();
+    }
+
+    void setExportInterleave(const bool _exportInterleave) {
+        exportInterleave = _exportInterleave;
+    }
+
+    void setVerifyPositions(const int _verifyPositions) {
+        verifyPositions = _verifyPositions;
+    }
+
+    void setHogwild(const bool _hogwild) {
+        hogwild = _hogwild;
+
+        if (hogwild) {
+            sparseGradients.resize(pool.size());
+        }
+    }
+
+    bool getHogwild() const {
+        return hogwild;
+    }
+
+    Partition getPartition() const {
+        return partition;
+    }
+
+    BackwardMode getBackwardMode() const {
+        return backwardMode;
+    }
 };
\ No newline at end of file
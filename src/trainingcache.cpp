@@ -0,0 +1,127 @@
+#include "trainingcache.h"
+#include "dataloader.h"
+#include "random.h"
+
+#include <fstream>
+#include <iostream>
+#include <numeric>
+
+namespace DataLoader {
+
+    bool CacheFile::isCache(const std::string& path) {
+        std::ifstream file(path, std::ios::binary);
+        char          magic[8];
+
+        return file.read(magic, sizeof(magic)) && std::memcmp(magic, CACHE_MAGIC, sizeof(magic)) == 0;
+    }
+
+    bool CacheFile::open(const std::string& path) {
+        if (!file.open(path) || file.size() < sizeof(CacheHeader)) {
+            return false;
+        }
+
+        CacheHeader header;
+        std::memcpy(&header, file.data(), sizeof(CacheHeader));
+
+        if (std::memcmp(header.magic, CACHE_MAGIC, sizeof(CACHE_MAGIC)) != 0 || header.version != CACHE_VERSION || header.recordSize != sizeof(PackedEntry)) {
+            std::cout << "Unsupported training cache " << path << std::endl;
+            return false;
+        }
+
+        if (sizeof(CacheHeader) + header.count * sizeof(PackedEntry) > file.size()) {
+            std::cout << "Truncated training cache " << path << std::endl;
+            return false;
+        }
+
+        records = reinterpret_cast<const PackedEntry*>(file.data() + sizeof(CacheHeader));
+        count   = header.count;
+
+        file.advise(0, file.size(), MappedFile::Advice::Random);
+
+        return count > 0;
+    }
+
+    std::size_t CacheFile::blockAt(const std::uint64_t step) const {
+        const std::uint64_t blocks = blockCount();
+        const std::uint64_t pass   = step / blocks;
+
+        // Affine permutation (a * i + c) mod blocks, a has to be coprime to blocks
+        std::uint64_t a = splitmix64(pass) % blocks | 1;
+        while (std::gcd(a, blocks) != 1) {
+            a += 2;
+        }
+        const std::uint64_t c = splitmix64(pass ^ 0x5851F42D4C957F2Dull) % blocks;
+
+        return (a % blocks * (step % blocks) + c) % blocks;
+    }
+
+    bool convertToCache(const std::string& binpackPath, const std::string& cachePath, const int threads, const FilterChain& filters) {
+        BinpackFile binpack;
+        if (!binpack.open(binpackPath, threads)) {
+            std::cout << "Couldn't read binpack " << binpackPath << std::endl;
+            return false;
+        }
+
+        std::ofstream output(cachePath, std::ios::binary | std::ios::trunc);
+        if (!output) {
+            std::cout << "Couldn't write training cache " << cachePath << std::endl;
+            return false;
+        }
+
+        CacheHeader header{};
+        std::memcpy(header.magic, CACHE_MAGIC, sizeof(CACHE_MAGIC));
+        header.version    = CACHE_VERSION;
+        header.recordSize = sizeof(PackedEntry);
+        output.write(reinterpret_cast<const char*>(&header), sizeof(header));
+
+        std::atomic<std::size_t> nextChunk{0};
+        std::atomic<int>         workerIndex{0};
+        std::mutex               outputMutex;
+        FilterCounters           counters;
+
+        auto worker = [&]() {
+            std::vector<PackedEntry> records;
+            Random                   random(workerIndex.fetch_add(1));
+            FilterStats              stats;
+
+            for (std::size_t index; (index = nextChunk.fetch_add(1)) < binpack.chunkCount();) {
+                records.clear();
+
+                decodeChunk(binpack.chunk(index), [&](const binpack::TrainingDataEntry& entry) {
+                    if (filters.accept(entry, random, stats)) {
+                        records.push_back(PackedEntry::fromEntry(entry));
+                    }
+                });
+
+                counters.add(stats);
+
+                std::lock_guard<std::mutex> lock(outputMutex);
+                output.write(reinterpret_cast<const char*>(records.data()), records.size() * sizeof(PackedEntry));
+                header.count += records.size();
+            }
+        };
+
+        std::vector<std::thread> workers;
+        for (int i = 0; i < std::max(1, threads); ++i) {
+            workers.emplace_back(worker);
+        }
+        for (auto& thread : workers) {
+            thread.join();
+        }
+
+        output.seekp(0);
+        output.write(reinterpret_cast<const char*>(&header), sizeof(header));
+
+        const FilterStats stats = counters.take();
+
+        std::cout << "Converted " << binpackPath << " to " << cachePath << ": kept " << header.count << " of " << stats.seen << " positions" << std::endl;
+        for (std::size_t i = 0; i < FILTER_COUNT; ++i) {
+            if (stats.rejected[i] > 0) {
+                std::cout << "  " << filterName(static_cast<Filter>(i)) << " rejected " << stats.rejected[i] << std::endl;
+            }
+        }
+
+        return static_cast<bool>(output);
+    }
+
+} // namespace DataLoader
@@ -0,0 +1,67 @@
+#pragma once
+
+#include "filter.h"
+#include "mappedfile.h"
+#include "packedentry.h"
+
+#include <algorithm>
+#include <span>
+#include <string>
+
+namespace DataLoader {
+
+    // On disk cache of already filtered positions as fixed size PackedEntry
+    // records. Decoding and filtering the binpack happens once at conversion,
+    // training then reads the records straight from a memory mapping.
+    struct CacheHeader {
+        char          magic[8];
+        std::uint32_t version;
+        std::uint32_t recordSize;
+        std::uint64_t count;
+        std::uint64_t reserved;
+    };
+
+    static_assert(sizeof(CacheHeader) == sizeof(PackedEntry));
+
+    constexpr char          CACHE_MAGIC[8]   = {'R', 'I', 'C', 'E', 'C', 'A', 'C', 'H'};
+    constexpr std::uint32_t CACHE_VERSION    = 1;
+    constexpr std::size_t   CACHE_BLOCK_SIZE = 1024;
+
+    class CacheFile {
+    private:
+        MappedFile         file;
+        const PackedEntry* records = nullptr;
+        std::size_t        count   = 0;
+
+    public:
+        // True if the file starts with the cache header
+        static bool isCache(const std::string& path);
+
+        bool open(const std::string& path);
+
+        bool isOpen() const {
+            return records != nullptr;
+        }
+
+        std::size_t size() const {
+            return count;
+        }
+
+        std::size_t blockCount() const {
+            return (count + CACHE_BLOCK_SIZE - 1) / CACHE_BLOCK_SIZE;
+        }
+
+        std::span<const PackedEntry> block(const std::size_t index) const {
+            const std::size_t begin = index * CACHE_BLOCK_SIZE;
+            return {records + begin, std::min(CACHE_BLOCK_SIZE, count - begin)};
+        }
+
+        // The block read at the given step. Every pass over the file visits
+        // all blocks in a new pseudo random order.
+        std::size_t blockAt(const std::uint64_t step) const;
+    };
+
+    // Decodes and filters a binpack on `threads` threads and writes the cache
+    bool convertToCache(const std::string& binpackPath, const std::string& cachePath, const int threads, const FilterChain& filters);
+
+} // namespace DataLoader
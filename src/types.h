@@ -1,11 +1,19 @@
 #pragma once
 
+#include "alignedbuffer.h"
+#include "quantscheme.h"
+
 #include <cstdint>
 #include <array>
 #include <random>
 #include <cstring>
 #include <sstream>
+#include <string>
+#include <vector>
 #include <chrono>
+#include <cmath>
+
+struct FileSection;
 
 constexpr int INPUT_SIZE = 64 * 6 * 2;
 constexpr int HIDDEN_SIZE = 256;
@@ -14,39 +22,20 @@ constexpr int OUTPUT_SIZE = 1;
 constexpr float EVAL_SCALE = 400.0f;
 constexpr float EVAL_CP_RATIO = 0.7f;
 
-constexpr int THREADS = 6;
-
 constexpr float BETA1 = 0.9f;
 constexpr float BETA2 = 0.999f;
 constexpr float EPSILON = 1e-8f;
 
-constexpr std::size_t EPOCH_SIZE = 1e9;
-
-struct Features
-{
-    uint8_t n = 0;
-    std::array<std::array<int16_t, 2>, 32> features;
-
-    void add(int16_t featureWhite, int16_t featureBlack)
-    {
-        features[n][0] = featureWhite;
-        features[n][1] = featureBlack;
-        n++;
-    }
-    void clear()
-    {
-        n = 0;
-    }
-};
-
 struct NN {
     using Accumulator = std::array<float, HIDDEN_SIZE * 2>;
     using Color = uint8_t;
 
-    std::array<float, INPUT_SIZE * HIDDEN_SIZE> inputFeatures;
-    std::array<float, HIDDEN_SIZE> inputBias;
-    std::array<float, HIDDEN_SIZE * 2> hiddenFeatures;
-    std::array<float, OUTPUT_SIZE> hiddenBias;
+    // Cache line aligned, so threads splitting the hidden columns on line
+    // boundaries never share a line
+    alignas(64) std::array<float, INPUT_SIZE * HIDDEN_SIZE> inputFeatures;
+    alignas(64) std::array<float, HIDDEN_SIZE> inputBias;
+    alignas(64) std::array<float, HIDDEN_SIZE * 2> hiddenFeatures;
+    alignas(64) std::array<float, OUTPUT_SIZE> hiddenBias;
 
     NN(){
         std::random_device rd;
@@ -66,8 +55,54 @@ struct NN {
         std::memset(hiddenBias.data(), 0, sizeof(float) * OUTPUT_SIZE);
     }
 
-    const float forward(Accumulator& accumulator, Features& features, Color stm) const;
+    // Optional bf16 copy of inputFeatures read by the forward pass in mixed
+    // precision mode, the fp32 weights stay the master copy the optimizer
+    // updates. Empty when disabled.
+    AlignedBuffer<uint16_t> inputShadow;
+
+    bool mixedPrecision() const {
+        return inputShadow.size() > 0;
+    }
+
+    void setMixedPrecision(bool enabled);
+
+    // Quantization aware training: the forward pass runs on the weights the
+    // way the engine stores them, rounded to the fixed point scheme, with
+    // int16 accumulator saturation and the eval truncated to whole
+    // centipawns. The fp32 weights stay the master copy and gradients pass
+    // the rounding unchanged (straight through estimator).
+    QuantScheme                        quant;
+    AlignedBuffer<int16_t>             inputQuantized;
+    alignas(64) std::array<float, HIDDEN_SIZE>     inputBiasQuantized; // whole numbers, scaled by qa
+    alignas(64) std::array<float, HIDDEN_SIZE * 2> hiddenQuantized;    // dequantized
+    float                              hiddenBiasQuantized = 0;
+
+    bool quantized() const {
+        return inputQuantized.size() > 0;
+    }
+
+    void setQuantization(bool enabled, const QuantScheme& scheme);
+
+    // Copies inputFeatures[offset, offset + n) into the bf16 or quantized shadow
+    void refreshShadow(std::size_t offset, int n);
+
+    // Requantizes the input bias and the output layer, cheap enough to run after every step
+    void refreshQuantizedDense();
+
+    // Both of the above over the whole network, after the weights were replaced
+    void refreshShadows();
+
+    // Output as the engine would report it, truncated to whole centipawns
+    static float truncateEval(const float output) {
+        return std::trunc(output * EVAL_SCALE) / EVAL_SCALE;
+    }
+
+    // Features are given per perspective, side to move first
+    const float forward(Accumulator& accumulator, const int16_t* stmFeatures, const int16_t* nstmFeatures, int count) const;
     void load(const std::string& path);
+
+    // Byte ranges of the checkpoint file, in order
+    std::vector<FileSection> sections() const;
     void save(const std::string& path);
 };
 